@@ -0,0 +1,90 @@
+// alloc.h: Block allocation policies
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+class Allocator {
+protected:
+    // Length of the free run starting at a block
+    // @param	refs	    Reference count of every block
+    // @param	blocknum    First block of the run
+    static uint32_t freeRun(const std::vector<uint32_t> &refs, uint32_t blocknum);
+
+public:
+    // Create a policy by name: first-fit, next-fit, best-fit or groups
+    // @param	name	    Policy name
+    // Returns nullptr if the name is unknown.
+    static Allocator *create(const std::string &name);
+
+    // Destructor
+    virtual ~Allocator() {}
+
+    // Return the policy name
+    virtual const char *name() const = 0;
+
+    // Pick a free block
+    // @param	refs	    Reference count of every block (0 if free)
+    // @param	first	    First block that may be allocated
+    // @param	hint	    Block that would extend the file's last run (0 if none)
+    // @param	want	    Number of blocks about to be allocated for the file in a row
+    // @param	home	    Block near the file's inode where its data belongs (0 if none)
+    // Returns 0 if no block is free.
+    virtual uint32_t allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home) = 0;
+
+    // Measure free space fragmentation, from 0 (one free run) to 1
+    // @param	refs	    Reference count of every block (0 if free)
+    // @param	first	    First block that may be allocated
+    virtual double fragmentation(const std::vector<uint32_t> &refs, uint32_t first) const;
+};
+
+// Lowest free block; the historical behaviour
+class FirstFit : public Allocator {
+public:
+    const char *name() const { return "first-fit"; }
+    uint32_t allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home);
+};
+
+// Continue the file, else resume scanning where the last allocation ended
+class NextFit : public Allocator {
+private:
+    uint32_t Cursor;	    // Block after the last allocation
+
+public:
+    NextFit() : Cursor(0) {}
+    const char *name() const { return "next-fit"; }
+    uint32_t allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home);
+};
+
+// Continue the file, else start it in the smallest free run that holds the whole write
+class BestFit : public Allocator {
+public:
+    const char *name() const { return "best-fit"; }
+    uint32_t allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home);
+};
+
+// Split the disk into groups and keep each file in the group holding its home block
+class BlockGroups : public Allocator {
+private:
+    // Group boundaries for a disk
+    // @param	refs	    Reference count of every block
+    // @param	first	    First block that may be allocated
+    // @param	group	    Group number
+    // @param	start	    Set to the first block of the group
+    // @param	end	    Set to the block after the group
+    static void bounds(const std::vector<uint32_t> &refs, uint32_t first, size_t group, uint32_t &start, uint32_t &end);
+
+public:
+    // Number of groups the data blocks are split into
+    const static size_t GROUPS = 16;
+
+    const char *name() const { return "groups"; }
+    uint32_t allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home);
+
+    // Average fragmentation of the groups, since files never span them by choice
+    double fragmentation(const std::vector<uint32_t> &refs, uint32_t first) const;
+};
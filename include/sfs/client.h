@@ -0,0 +1,99 @@
+// client.h: Block server client
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+class Client {
+	public:
+		// Operation codes
+		const static uint32_t OP_CREATE = 1;
+		const static uint32_t OP_REMOVE = 2;
+		const static uint32_t OP_STAT   = 3;
+		const static uint32_t OP_READ   = 4;
+		const static uint32_t OP_WRITE  = 5;
+
+		// Largest read or write payload carried by one operation
+		const static uint64_t MAX_PAYLOAD = 16 << 20;
+
+		struct Request {		// Sent for every operation
+			uint32_t Op;		// Operation code
+			uint32_t Reserved;
+			uint64_t Inumber;	// Inode operated on
+			uint64_t Length;	// Bytes to read, or bytes of data following a write
+			uint64_t Offset;	// Offset into the file
+		};
+
+		struct Response {		// Returned for every operation, in request order
+			uint32_t Op;		// Operation code of the request
+			uint32_t Reserved;
+			int64_t  Result;	// FileSystem return value
+			uint64_t Length;	// Bytes of data following (reads only)
+		};
+
+	private:
+		struct Pending {		// Operation queued in a batch
+			Request request;
+			char *data;		// Caller's read buffer
+		};
+
+		int Socket;			// Connection to the server
+		bool Batching;			// Whether operations are being queued
+		std::vector<Pending> Queue;	// Operations awaiting commit
+		std::vector<char> Outgoing;	// Encoded requests awaiting send
+
+		// Internal helper functions
+
+		ssize_t submit(uint32_t op, size_t inumber, const char *data, char *buffer, size_t length, size_t offset);
+		bool sendAll(const char *data, size_t length);
+		bool recvAll(char *data, size_t length);
+
+	public:
+		// Default constructor
+		Client() : Socket(-1), Batching(false) {}
+
+		// Destructor
+		~Client();
+
+		// Connect to a block server
+		// @param	path		Path to the server's Unix-domain socket
+		bool connect(const char *path);
+
+		// Create an inode
+		ssize_t create();
+
+		// Remove an inode
+		// @param	inumber		Inode to remove
+		bool    remove(size_t inumber);
+
+		// Return the size of an inode
+		// @param	inumber		Inode to stat
+		ssize_t stat(size_t inumber);
+
+		// Read from an inode
+		// @param	inumber		Inode to read from
+		// @param	data		Buffer to read into
+		// @param	length		Number of bytes to be read
+		// @param	offset		Offset where reading should start
+		ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
+
+		// Write to an inode
+		// @param	inumber		Inode to write to
+		// @param	data		Buffer to write from
+		// @param	length		Number of bytes to be written
+		// @param	offset		Offset where writing should start
+		ssize_t write(size_t inumber, const char *data, size_t length, size_t offset);
+
+		// Start queuing operations instead of running them one round trip at a time
+		// Queued operations return 0; their results come from commit.
+		void begin();
+
+		// Send every queued operation at once and collect the results in order
+		// Read data lands in the buffers passed to read.
+		// Returns an empty vector if the connection failed.
+		std::vector<ssize_t> commit();
+};
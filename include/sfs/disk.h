@@ -5,9 +5,11 @@
 #include <stdlib.h>
 
 class Disk {
-private:
+protected:
     int	    FileDescriptor; // File descriptor of disk image
+    size_t  Bytes;	    // Length of disk image in bytes
     size_t  Blocks;	    // Number of blocks in disk image
+    size_t  BlockSize;	    // Number of bytes per block
     size_t  Reads;	    // Number of reads performed
     size_t  Writes;	    // Number of writes performed
     size_t  Mounts;	    // Number of mounts
@@ -19,24 +21,38 @@ private:
     void sanity_check(int blocknum, void *data);
 
 public:
-    // Number of bytes per block
+    // Number of bytes per block of a freshly opened disk (and the smallest block size)
     const static size_t BLOCK_SIZE = 4096;
+
+    // Largest supported block size
+    const static size_t MAX_BLOCK_SIZE = 1 << 20;
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : FileDescriptor(0), Bytes(0), Blocks(0), BlockSize(BLOCK_SIZE), Reads(0), Writes(0), Mounts(0) {}
     
     // Destructor
-    ~Disk();
+    virtual ~Disk();
 
     // Open disk image
     // @param	path	    Path to disk image
-    // @param	nblocks	    Number of blocks in disk image
+    // @param	nblocks	    Number of BLOCK_SIZE blocks in disk image
     // Throws runtime_error exception on error.
     void open(const char *path, size_t nblocks);
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
 
+    // Return length of disk image in bytes
+    size_t bytes() const { return Bytes; }
+
+    // Return number of bytes per block
+    size_t blockSize() const { return BlockSize; }
+
+    // Regroup the disk into blocks of another size
+    // @param	size	    Power of two between BLOCK_SIZE and MAX_BLOCK_SIZE
+    // Returns false if the size is not supported.
+    virtual bool setBlockSize(size_t size);
+
     // Return whether or not disk is mounted
     bool mounted() const { return Mounts > 0; }
 
@@ -49,10 +65,22 @@ public:
     // Read block from disk
     // @param	blocknum    Block to read from
     // @param	data	    Buffer to read into
-    void read(int blocknum, void *data);
+    virtual void read(int blocknum, void *data);
     
     // Write block to disk
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
-    void write(int blocknum, void *data);
+    virtual void write(int blocknum, void *data);
+
+    // Read a run of consecutive blocks from disk
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*blockSize() bytes to read into
+    virtual void read(int blocknum, size_t nblocks, void *data);
+
+    // Write a run of consecutive blocks to disk
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*blockSize() bytes to write from
+    virtual void write(int blocknum, size_t nblocks, void *data);
 };
@@ -0,0 +1,72 @@
+// faulty.h: Fault-injecting disk for crash testing
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <string>
+#include <vector>
+
+class FaultyDisk : public Disk {
+private:
+    struct Write {			    // One block write as issued
+    	size_t	    Offset;		    // Byte offset into the image
+    	std::string Data;		    // Block contents
+    };
+
+    std::string Durable;		    // Image as of the last checkpoint
+    std::string Current;		    // Image as seen by reads
+    std::vector<Write> Log;		    // Writes issued since the last checkpoint
+
+    // Check that a run of blocks fits on the disk
+    // @param	blocknum    First block to operate on
+    // @param	nblocks	    Number of blocks to operate on
+    // @param	data	    Buffer to operate on
+    // Throws invalid_argument exception on error.
+    void sanity_check(int blocknum, size_t nblocks, void *data);
+
+public:
+    // Bytes a torn write persists at a time
+    const static size_t SECTOR_SIZE = 512;
+
+    // Create an in-memory image filled with zeroes
+    // @param	nblocks	    Number of BLOCK_SIZE blocks in disk image
+    void open(size_t nblocks);
+
+    // Read block from the image
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(int blocknum, void *data);
+
+    // Write block to the image and log it
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(int blocknum, void *data);
+
+    // Read a run of consecutive blocks from the image
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*blockSize() bytes to read into
+    void read(int blocknum, size_t nblocks, void *data);
+
+    // Write a run of consecutive blocks, logging each block separately since
+    // a run is not atomic on real hardware
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*blockSize() bytes to write from
+    void write(int blocknum, size_t nblocks, void *data);
+
+    // Return the number of writes issued since the last checkpoint
+    size_t writes() const { return Log.size(); }
+
+    // Make every write so far durable and clear the log
+    void checkpoint();
+
+    // Lose power and keep only what reached the media; the disk comes back
+    // unmounted with the surviving image as its new checkpoint
+    // @param	count	    Number of logged writes issued before power failed
+    // @param	torn	    Sectors of the last issued write that persisted (0 for all of it)
+    // @param	reorder	    Number of the latest writes still in a volatile cache, each lost at random
+    // @param	seed	    Seed choosing which cached writes are lost
+    void crash(size_t count, size_t torn = 0, size_t reorder = 0, unsigned seed = 0);
+};
@@ -2,36 +2,71 @@
 
 #pragma once
 
+#include "sfs/alloc.h"
 #include "sfs/disk.h"
 
+#include <memory>
+#include <vector>
+
 #include <stdint.h>
 
 class FileSystem {
 	public:
 		const static uint32_t MAGIC_NUMBER	     = 0xf0f03410;
-		const static uint32_t INODES_PER_BLOCK   = 128;
-		const static uint32_t INODES_PERCENT = 10;
+		const static uint32_t INODE_VALID = 1;		// Inode is in use
+		const static uint32_t INODE_INLINE = 2;		// File data lives in Inline
+		const static uint32_t INODE_SIZE = 128;		// Bytes per on-disk inode
+		const static uint32_t LEGACY_INODE_SIZE = 32;	// Inode size of images without inline data
+		const static uint32_t INLINE_SIZE = INODE_SIZE - 2 * sizeof(uint32_t);
+		const static uint32_t INODES_PER_BLOCK   = Disk::BLOCK_SIZE / INODE_SIZE;
+		// A block holds a quarter as many 128-byte inodes as legacy ones, so
+		// the default share gives 4x fewer inodes than before; files of up to
+		// INLINE_SIZE bytes need no data block in return. Images of many small
+		// files should be formatted with a larger share or 0.
+		const static uint32_t INODES_PERCENT = 10;	// Default share of blocks given to inodes (0 to grow on demand)
 		const static uint32_t POINTERS_PER_INODE = 5;
-		const static uint32_t POINTERS_PER_BLOCK = 1024;
+		const static uint32_t POINTERS_PER_BLOCK = 1024;	// Pointers per Disk::BLOCK_SIZE block
 		const static uint32_t BLOCK_UNSET = 0;
+		const static uint32_t SNAPSHOTS_PER_BLOCK = 256;
+		const static uint32_t CLEAR_BLOCKS = 256;	// Disk::BLOCK_SIZE blocks zeroed per write during format
 
 	private:
 		struct SuperBlock {		// Superblock structure
 			uint32_t MagicNumber;	// File system magic number
 			uint32_t Blocks;	// Number of blocks in file system
-			uint32_t InodeBlocks;	// Number of blocks reserved for inodes
+			uint32_t InodeBlocks;	// Number of blocks reserved for inodes (0 if allocated on demand)
 			uint32_t Inodes;	// Number of inodes in file system
+			uint32_t InodeSize;	// Bytes per on-disk inode (0 for legacy images)
+			uint32_t Snapshots;	// Block holding the snapshot table (0 if none)
+			uint32_t BlockSize;	// Bytes per block (0 for Disk::BLOCK_SIZE)
+			uint32_t InodeTable;	// Pointer block listing inode blocks allocated on demand
 		};
 
 		struct Inode {
-			uint32_t Valid;		// Whether or not inode is valid
+			uint32_t Valid;		// Whether or not inode is valid (INODE_* flags)
 			uint32_t Size;		// Size of file
-			uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
-			uint32_t Indirect;	// Indirect pointer
+			union {
+				struct {
+					uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+					uint32_t Indirect;	// Indirect pointer
+				};
+				char Inline[INLINE_SIZE];	// File data when INODE_INLINE is set
+			};
+		};
+
+		struct Snapshot {
+			uint32_t Valid;		// Whether or not snapshot is valid
+			uint32_t Created;	// Time the snapshot was taken
+			uint32_t Table;		// Pointer block listing the frozen inode blocks (0 where none were valid)
+			uint32_t Extra;		// Pointer block listing pointer blocks for the rest of the table (0 if none)
 		};
 
+		// Layout of the first Disk::BLOCK_SIZE bytes of a block; larger blocks
+		// hold more inodes and pointers, but the superblock and snapshot table
+		// only ever use this much
 		union Block {
 			SuperBlock  Super;			    // Superblock
+			Snapshot    Snapshots[SNAPSHOTS_PER_BLOCK]; // Snapshot table
 			Inode	    Inodes[INODES_PER_BLOCK];	    // Inode block
 			uint32_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block for double hashing
 			char	    Data[Disk::BLOCK_SIZE];	    // Data block
@@ -40,14 +75,57 @@ class FileSystem {
 		// Internal helper functions
 
 		bool isInumberValid(size_t inumber);
+		bool isBlockValid(uint32_t blocknum);
+		bool isSuperBlockValid();
+		void repairInode(Inode *inode);
 		uint32_t getBlockNumber(size_t inumber);
 		void loadMemBmap(Disk *disk);
+		uint32_t inodeSize();
+		uint32_t inodesPerBlock();
+		uint32_t inodeBlocks();
+		bool growInodes();
+		void shrinkInodes(uint32_t table, uint32_t blocks);
+		uint32_t readTable(Disk *disk, uint32_t table);
+		Inode *loadTable(uint32_t table);
+		void storeTable(uint32_t table);
+		uint32_t blockSize();
+		uint32_t pointersPerBlock();
+		char *dataBlock(uint32_t blocknum);
+		uint32_t *pointerBlock(uint32_t blocknum);
+		Snapshot *snapshotTable();
+		uint32_t homeBlock(size_t inumber);
+		uint32_t allocateBlock(uint32_t hint = 0, uint32_t want = 1, uint32_t home = 0);
+		void freeBlock(uint32_t blocknum);
+		void freeIndirect(uint32_t blocknum);
+		uint32_t copyBlock(uint32_t blocknum, uint32_t hint = 0, uint32_t home = 0);
+		void loadBlocks(Disk *disk, const std::vector<uint32_t> &blocks);
+		void referenceInode(Disk *disk, Inode *inode);
+		void shareInode(Inode *inode);
+		void releaseInode(Inode *inode);
+		Inode *loadSnapshot(size_t snapshot);
+		uint32_t *frozenPointer(Snapshot *snapshot, uint32_t index, bool allocate);
+		void freeFrozen(Snapshot *snapshot);
+		void packInodes(uint32_t index, uint32_t blocknum);
+		void unpackInodes(Inode *inodes, uint32_t index, uint32_t blocknum);
+		uint32_t *getPointer(Inode *inode, uint32_t index, bool allocate, uint32_t want = 1);
+		bool unshareIndirect(Inode *inode);
+		bool spillInline(Inode *inode);
+		uint32_t findRun(uint32_t length);
+
+		// Block copy loops, specialized for common block sizes (0 for any size)
+		template <uint32_t BlockSize>
+		ssize_t readBlocks(Inode *inode, char *data, size_t length, size_t offset);
+		template <uint32_t BlockSize>
+		ssize_t writeBlocks(Inode *inode, char *data, size_t length, size_t offset);
 
 		// Internal member variables
 
-		Block *memBmap;
+		char *memBmap;			// Blocks after the inode table, blockSize() bytes each
 		Block *memSuperBlock;
 		Inode *memInodes;
+		std::vector<uint32_t> memRefs;	// Number of references to each block
+		bool memReadOnly;		// Whether a snapshot is mounted
+		std::unique_ptr<Allocator> memAllocator;	// Block placement policy
 
 	public:
 		// Print debugging information
@@ -56,11 +134,14 @@ class FileSystem {
 
 		// Format a disk image
 		// @param	disk		Pointer to a disk object
-		static bool format(Disk *disk);
+		// @param	blockSize	Bytes per block, a power of two up to Disk::MAX_BLOCK_SIZE
+		// @param	inodesPercent	Share of blocks reserved for inodes (0 to allocate them on demand)
+		static bool format(Disk *disk, size_t blockSize = Disk::BLOCK_SIZE, uint32_t inodesPercent = INODES_PERCENT);
 
 		// Mount a disk image
 		// @param	disk		Pointer to a disk object
-		bool mount(Disk *disk);
+		// @param	snapshot	Snapshot to mount read-only (-1 for the live file system)
+		bool mount(Disk *disk, ssize_t snapshot = -1);
 
 		// Unmount a disk image
 		// @param	disk		Pointer to a disk object
@@ -69,6 +150,11 @@ class FileSystem {
 		// Create an inode
 		ssize_t create();
 
+		// Create a specific inode
+		// @param	inumber		Index into memInodes
+		// Returns -1 if the inode is already in use or out of range.
+		ssize_t create(size_t inumber);
+
 		// Remove an inode
 		// @param	inumber		Index into memInodes
 		bool    remove(size_t inumber);
@@ -90,4 +176,67 @@ class FileSystem {
 		// @param	length		Number of bytes to be read
 		// @param	offset		Offset where reading should start
 		ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+		// Return the largest file size the mounted block size can address
+		size_t maxFileSize();
+
+		// Change the size of a file, releasing blocks past the new end
+		// @param	inumber		Index into memInodes
+		// @param	size		New size of the file
+		bool truncate(size_t inumber, size_t size);
+
+		// Find the next inode in use
+		// @param	inumber		Index into memInodes where searching should start
+		// Returns -1 if there are no more inodes in use.
+		ssize_t nextInode(size_t inumber);
+
+		// Find the next data region of a file (like lseek SEEK_DATA)
+		// @param	inumber		Index into memInodes
+		// @param	offset		Offset where searching should start
+		// Returns -1 if there is no data at or after offset.
+		ssize_t seekData(size_t inumber, size_t offset);
+
+		// Find the next hole of a file (like lseek SEEK_HOLE)
+		// @param	inumber		Index into memInodes
+		// @param	offset		Offset where searching should start
+		// The end of the file counts as a hole.
+		ssize_t seekHole(size_t inumber, size_t offset);
+
+		// Create an inode sharing the blocks of another copy-on-write
+		// @param	inumber		Index into memInodes
+		// Returns the new inode or -1 on error.
+		ssize_t clone(size_t inumber);
+
+		// Freeze the inode table; later writes copy shared blocks
+		// Only inode blocks holding valid inodes are copied, so a snapshot
+		// costs a block per such block plus its pointer blocks.
+		// Returns the snapshot number or -1 on error.
+		ssize_t snapshot();
+
+		// Print the snapshot table
+		void snapshots();
+
+		// Delete a snapshot and release the blocks only it references
+		// @param	snapshot	Snapshot number
+		bool removeSnapshot(size_t snapshot);
+
+		// Choose the block allocation policy
+		// @param	name		first-fit, next-fit, best-fit or groups
+		bool setPolicy(const char *name);
+
+		// Return the name of the block allocation policy
+		const char *policy();
+
+		// Share of adjacent file blocks that are not adjacent on disk, from 0 to 1
+		double fileFragmentation();
+
+		// Free space fragmentation as measured by the allocation policy, from 0 to 1
+		double freeFragmentation();
+
+		// Move the blocks of the next fragmented file into the lowest free run that holds them
+		// @param	inumber		Index into memInodes where searching should start
+		// @param	moved		Set to the number of blocks relocated
+		// Files sharing blocks with clones or snapshots are left alone.
+		// Returns the inode examined or -1 when no inodes remain.
+		ssize_t defrag(size_t inumber, size_t &moved);
 };
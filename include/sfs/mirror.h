@@ -0,0 +1,123 @@
+// mirror.h: Mirrored disk volume
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+class MirroredDisk : public Disk {
+private:
+    struct Header {				    // Last block of each replica
+    	uint32_t MagicNumber;			    // Marks an initialized header
+    	uint32_t Generation;			    // Session or failure the replica last kept up with
+    };
+
+    std::vector<Disk *> Members;		    // Replicas holding identical blocks
+    std::vector<std::mutex *> Locks;		    // Serializes I/O to each replica
+    std::atomic<unsigned> *Pending;		    // In-flight requests per replica
+    std::vector<std::vector<uint32_t> > Sums;	    // Checksum table stored on each replica
+    std::vector<std::vector<bool> > Stale;	    // Blocks each replica does not hold current
+    std::vector<uint32_t> Checksums;		    // Checksum of each block's current contents
+    std::vector<bool> Split;			    // Blocks whose replicas disagree with no majority
+    std::vector<uint32_t> Generations;		    // Generation recorded on each replica
+    uint32_t Generation;			    // Newest generation; replicas behind it are stale
+    std::mutex State;				    // Protects Stale, Checksums, Split and Generations
+    size_t  TableBlocks;			    // Blocks reserved for each checksum table
+    unsigned Next;				    // Round-robin tie breaker
+
+    // Magic number of a replica header
+    const static uint32_t MAGIC_NUMBER = 0x3e1f7a31;
+
+    // Number of checksums per table block
+    const static size_t SUMS_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+
+    // Checksum a block (FNV-1a, never 0 so 0 can mean unknown)
+    // @param	data	    Block to checksum
+    static uint32_t checksum(const void *data);
+
+    // Pick the least busy replica holding a current copy of a block
+    // @param	blocknum    Block to read
+    // Returns the replica index or -1 if no replica is current.
+    int choose(int blocknum);
+
+    // Read a block from one replica, falling back to the others
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    // @param	first	    Replica to try first
+    void readBlock(int blocknum, void *data, size_t first);
+
+    // Write a run of blocks and their checksums to one replica
+    // Caller holds the replica's lock.
+    // @param	member	    Replica to write to
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void store(size_t member, int blocknum, size_t nblocks, const char *data);
+
+    // Write a run of blocks to every replica in parallel
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void fanout(int blocknum, size_t nblocks, char *data);
+
+    // Write a generation to one replica's header
+    // Caller holds the replica's lock and updates Generations.
+    // @param	member	    Replica to write to
+    // @param	generation  Generation the replica is current with
+    void stamp(size_t member, uint32_t generation);
+
+public:
+    // Default constructor
+    MirroredDisk() : Pending(nullptr), Generation(0), TableBlocks(0), Next(0) {}
+
+    // Destructor
+    ~MirroredDisk();
+
+    // Open replica disk images; replicas from an older generation and those
+    // that disagree with a strict majority of the rest go stale
+    // @param	paths	    Paths to replica disk images
+    // @param	nblocks	    Number of blocks in the volume
+    // Throws runtime_error exception on error.
+    void open(const std::vector<std::string> &paths, size_t nblocks);
+
+    // Checksum tables are laid out in BLOCK_SIZE blocks, so only that size is supported
+    // @param	size	    Requested block size
+    bool setBlockSize(size_t size) { return size == BLOCK_SIZE; }
+
+    // Read block from the least busy replica
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(int blocknum, void *data);
+
+    // Write block to every replica
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(int blocknum, void *data);
+
+    // Read a run of blocks, spreading it across replicas in parallel
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    void read(int blocknum, size_t nblocks, void *data);
+
+    // Write a run of blocks to every replica in parallel
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void write(int blocknum, size_t nblocks, void *data);
+
+    // Copy diverged blocks from a current replica to the others; blocks
+    // without a majority copy are left alone
+    // @param	full	    Also read back every block to catch silent corruption
+    // Returns the number of block copies made.
+    size_t resync(bool full = false);
+
+    // Return the number of blocks whose replicas disagree with no majority
+    size_t conflicts();
+};
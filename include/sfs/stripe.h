@@ -0,0 +1,86 @@
+// stripe.h: Striped disk volume
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <string>
+#include <vector>
+
+class StripedDisk : public Disk {
+private:
+    struct Geometry {		    // Header kept in the block after each member's stripe units
+    	uint32_t MagicNumber;	    // Geometry magic number
+    	uint32_t StripeBlocks;	    // Number of consecutive blocks per member
+    	uint32_t Members;	    // Number of members in the volume
+    	uint32_t Index;		    // Position of this member in stripe order
+    };
+
+    std::vector<Disk *> Members;    // Member disks, in stripe order
+    size_t  StripeBlocks;	    // Number of consecutive blocks per member
+
+    // Magic number identifying a geometry header
+    const static uint32_t MAGIC_NUMBER = 0x5791fe00;
+
+    // Read the geometry header at the end of an existing member image
+    // @param	path	    Path to member disk image
+    // @param	geometry    Set to the header found
+    // Returns false if the image is missing or has no header.
+    static bool readGeometry(const char *path, Geometry &geometry);
+
+    // Map a logical block to a member disk and a block on that member
+    // @param	blocknum    Logical block
+    // @param	member	    Set to the index of the member disk
+    // Returns the block number on the member disk.
+    int locate(int blocknum, size_t &member);
+
+    // Run a block transfer, splitting it across members in parallel
+    // @param	blocknum    First logical block
+    // @param	nblocks	    Number of blocks
+    // @param	data	    Buffer of nblocks*blockSize() bytes
+    // @param	writing	    Whether to write rather than read
+    void transfer(int blocknum, size_t nblocks, char *data, bool writing);
+
+public:
+    // Default number of blocks per stripe unit
+    const static size_t DEFAULT_STRIPE = 16;
+
+    // Default constructor
+    StripedDisk() : StripeBlocks(DEFAULT_STRIPE) {}
+
+    // Destructor
+    ~StripedDisk();
+
+    // Open member disk images; members striped with another geometry are refused
+    // @param	paths	    Paths to member disk images
+    // @param	nblocks	    Number of logical blocks in the volume
+    // @param	stripe	    Number of consecutive blocks per member
+    // Throws runtime_error exception on error.
+    void open(const std::vector<std::string> &paths, size_t nblocks, size_t stripe = DEFAULT_STRIPE);
+
+    // Regroup the volume and every member into blocks of another size
+    // @param	size	    Power of two between BLOCK_SIZE and MAX_BLOCK_SIZE
+    bool setBlockSize(size_t size);
+
+    // Read block from volume
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(int blocknum, void *data);
+
+    // Write block to volume
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(int blocknum, void *data);
+
+    // Read a run of blocks, issuing member I/O in parallel
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*blockSize() bytes to read into
+    void read(int blocknum, size_t nblocks, void *data);
+
+    // Write a run of blocks, issuing member I/O in parallel
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*blockSize() bytes to write from
+    void write(int blocknum, size_t nblocks, void *data);
+};
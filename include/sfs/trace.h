@@ -0,0 +1,82 @@
+// trace.h: Operation tracing
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef SFS_TRACE
+#include <atomic>
+#endif
+
+// Spans are compiled in with -DSFS_TRACE (make TRACE=1) and recorded only
+// while tracing is enabled; each thread writes its own ring buffer, which is
+// reused by a later thread once its owner exits.
+
+class Trace {
+public:
+    // Number of spans kept per thread before the oldest are overwritten
+    const static size_t RING_EVENTS = 1 << 16;
+
+#ifdef SFS_TRACE
+    // Whether spans are being recorded
+    static std::atomic<bool> Active;
+
+    // Return a monotonic timestamp in nanoseconds
+    static uint64_t now();
+
+    // Record a finished span in the calling thread's ring buffer
+    // @param	category    Span category
+    // @param	name	    Span name
+    // @param	start	    Timestamp the span began
+    // @param	end	    Timestamp the span ended
+    static void record(const char *category, const char *name, uint64_t start, uint64_t end);
+#endif
+
+    // Return whether tracing was compiled in
+    static bool available();
+
+    // Start or stop recording spans
+    // @param	on	    Whether to record
+    static void enable(bool on);
+
+    // Return whether spans are being recorded
+    static bool enabled();
+
+    // Discard every recorded span
+    static void clear();
+
+    // Write recorded spans as Chrome trace JSON (loadable in Perfetto)
+    // @param	path	    Output file
+    static bool dump(const char *path);
+};
+
+#ifdef SFS_TRACE
+
+// Records the lifetime of a scope as one span
+class TraceSpan {
+private:
+    const char *Category;
+    const char *Name;
+    uint64_t	Start;	    // 0 if tracing was off when the scope began
+
+public:
+    TraceSpan(const char *category, const char *name)
+    	: Category(category), Name(name), Start(Trace::Active.load(std::memory_order_relaxed) ? Trace::now() : 0) {}
+
+    ~TraceSpan() {
+    	if (Start) {
+    	    Trace::record(Category, Name, Start, Trace::now());
+    	}
+    }
+};
+
+#define SFS_TRACE_CONCAT2(a, b)		a##b
+#define SFS_TRACE_CONCAT(a, b)		SFS_TRACE_CONCAT2(a, b)
+#define SFS_TRACE_SPAN(category, name)	TraceSpan SFS_TRACE_CONCAT(traceSpan, __LINE__)(category, name)
+
+#else
+
+#define SFS_TRACE_SPAN(category, name)
+
+#endif
@@ -0,0 +1,300 @@
+// sfsfuse.cpp: Simple file system FUSE daemon
+
+#define FUSE_USE_VERSION 31
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <fuse.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Files appear in a single directory, named by inode number
+
+const static size_t MAX_TRANSFER = 1 << 20;
+
+// Global state
+
+Disk		Image;
+FileSystem	Fs;
+pthread_rwlock_t Lock = PTHREAD_RWLOCK_INITIALIZER;	// Readers share, writers exclude
+
+// Helper functions
+
+ssize_t path_to_inumber(const char *path) {
+	char *end;
+
+	if (path[0] != '/' || path[1] == 0) {
+		return -1;
+	}
+
+	long inumber = strtol(path + 1, &end, 10);
+	if (*end != 0 || inumber < 0) {
+		return -1;
+	}
+
+	return inumber;
+}
+
+// FUSE operations
+
+void *sfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+	// Large requests and kernel-side write-back keep round trips down
+
+	conn->max_write = MAX_TRANSFER;
+	conn->max_read = MAX_TRANSFER;
+	conn->max_readahead = MAX_TRANSFER;
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	}
+
+	cfg->kernel_cache = 1;
+	cfg->use_ino = 1;
+	cfg->attr_timeout = 1.0;
+	cfg->entry_timeout = 1.0;
+	return nullptr;
+}
+
+void sfs_destroy(void *private_data) {
+	pthread_rwlock_wrlock(&Lock);
+	Fs.umount(&Image);
+	pthread_rwlock_unlock(&Lock);
+}
+
+int sfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+	memset(st, 0, sizeof(struct stat));
+
+	if (strcmp(path, "/") == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_rdlock(&Lock);
+	ssize_t size = Fs.nextInode(inumber) == inumber ? Fs.stat(inumber) : -1;
+	pthread_rwlock_unlock(&Lock);
+
+	if (size < 0) {
+		return -ENOENT;
+	}
+
+	st->st_ino = inumber + 1;
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blksize = Image.blockSize();
+	st->st_blocks = (size + 511) / 512;
+	return 0;
+}
+
+int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	if (strcmp(path, "/") != 0) {
+		return -ENOENT;
+	}
+
+	filler(buf, ".", nullptr, 0, (fuse_fill_dir_flags)0);
+	filler(buf, "..", nullptr, 0, (fuse_fill_dir_flags)0);
+
+	pthread_rwlock_rdlock(&Lock);
+	for (ssize_t inumber = Fs.nextInode(0); inumber >= 0; inumber = Fs.nextInode(inumber + 1)) {
+		char name[BUFSIZ];
+		snprintf(name, BUFSIZ, "%ld", inumber);
+		filler(buf, name, nullptr, 0, (fuse_fill_dir_flags)0);
+	}
+	pthread_rwlock_unlock(&Lock);
+
+	return 0;
+}
+
+int sfs_open(const char *path, struct fuse_file_info *fi) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_wrlock(&Lock);
+	ssize_t size = Fs.nextInode(inumber) == inumber ? Fs.stat(inumber) : -1;
+	if (size >= 0 && (fi->flags & O_TRUNC)) {
+		Fs.truncate(inumber, 0);
+	}
+	pthread_rwlock_unlock(&Lock);
+
+	return size < 0 ? -ENOENT : 0;
+}
+
+int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -EINVAL;
+	}
+
+	pthread_rwlock_wrlock(&Lock);
+	bool exists = Fs.nextInode(inumber) == inumber;
+	ssize_t result = exists ? -1 : Fs.create(inumber);
+	pthread_rwlock_unlock(&Lock);
+
+	if (exists) {
+		return -EEXIST;
+	}
+
+	return result < 0 ? -ENOSPC : 0;
+}
+
+int sfs_unlink(const char *path) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_wrlock(&Lock);
+	bool removed = Fs.remove(inumber);
+	pthread_rwlock_unlock(&Lock);
+
+	return removed ? 0 : -ENOENT;
+}
+
+int sfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_wrlock(&Lock);
+	bool exists = Fs.nextInode(inumber) == inumber;
+	bool truncated = exists && Fs.truncate(inumber, size);
+	pthread_rwlock_unlock(&Lock);
+
+	if (!exists) {
+		return -ENOENT;
+	}
+
+	return truncated ? 0 : -EFBIG;
+}
+
+int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_rdlock(&Lock);
+	ssize_t result = Fs.read(inumber, buf, size, offset);
+	pthread_rwlock_unlock(&Lock);
+
+	return result < 0 ? -EIO : result;
+}
+
+int sfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_wrlock(&Lock);
+	bool exists = Fs.nextInode(inumber) == inumber;
+	bool fits = (size_t)offset + size <= Fs.maxFileSize();
+	ssize_t result = exists && fits ? Fs.write(inumber, const_cast<char *>(buf), size, offset) : -1;
+	pthread_rwlock_unlock(&Lock);
+
+	if (!exists) {
+		return -ENOENT;
+	}
+
+	if (!fits) {
+		return -EFBIG;
+	}
+
+	return result < 0 ? -ENOSPC : result;
+}
+
+// Files have no times or permissions of their own, so changing them only
+// checks the file is there; tools like cp -p and touch expect that to work
+
+int sfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+	ssize_t inumber = path_to_inumber(path);
+	if (inumber < 0) {
+		return -ENOENT;
+	}
+
+	pthread_rwlock_rdlock(&Lock);
+	bool exists = Fs.nextInode(inumber) == inumber;
+	pthread_rwlock_unlock(&Lock);
+
+	return exists ? 0 : -ENOENT;
+}
+
+int sfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	return sfs_utimens(path, nullptr, fi);
+}
+
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// Data lives in memory until the daemon unmounts the image; there is
+	// nothing to flush earlier
+
+	return 0;
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <diskfile> <nblocks> <mountpoint> [FUSE options]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	try {
+		Image.open(argv[1], atoi(argv[2]));
+	} catch (std::runtime_error &e) {
+		fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+		return EXIT_FAILURE;
+	}
+
+	if (!Fs.mount(&Image)) {
+		fprintf(stderr, "Unable to mount %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	struct fuse_operations operations;
+	memset(&operations, 0, sizeof(operations));
+	operations.init     = sfs_init;
+	operations.destroy  = sfs_destroy;
+	operations.getattr  = sfs_getattr;
+	operations.readdir  = sfs_readdir;
+	operations.open     = sfs_open;
+	operations.create   = sfs_create;
+	operations.unlink   = sfs_unlink;
+	operations.truncate = sfs_truncate;
+	operations.read     = sfs_read;
+	operations.write    = sfs_write;
+	operations.utimens  = sfs_utimens;
+	operations.chmod    = sfs_chmod;
+	operations.fsync    = sfs_fsync;
+
+	// FUSE sees the mount point and its own options; the loop is multithreaded by default
+
+	char max_read[BUFSIZ];
+	snprintf(max_read, BUFSIZ, "max_read=%lu", MAX_TRANSFER);
+
+	std::vector<char *> args;
+	args.push_back(argv[0]);
+	for (int i = 3; i < argc; i++) {
+		args.push_back(argv[i]);
+	}
+	args.push_back((char *)"-o");
+	args.push_back(max_read);
+
+	return fuse_main(args.size(), args.data(), &operations, nullptr);
+}
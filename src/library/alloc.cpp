@@ -0,0 +1,171 @@
+// alloc.cpp: Block allocation policies
+
+#include "sfs/alloc.h"
+
+#include <algorithm>
+
+// Allocator -------------------------------------------------------------------
+
+Allocator *Allocator::create(const std::string &name) {
+    if (name == "first-fit") {
+    	return new FirstFit;
+    } else if (name == "next-fit") {
+    	return new NextFit;
+    } else if (name == "best-fit") {
+    	return new BestFit;
+    } else if (name == "groups") {
+    	return new BlockGroups;
+    }
+
+    return nullptr;
+}
+
+uint32_t Allocator::freeRun(const std::vector<uint32_t> &refs, uint32_t blocknum) {
+    uint32_t end = blocknum;
+    while (end < refs.size() && !refs[end]) {
+    	end++;
+    }
+
+    return end - blocknum;
+}
+
+double Allocator::fragmentation(const std::vector<uint32_t> &refs, uint32_t first) const {
+    // Share of free blocks outside the largest free run
+
+    uint32_t free = 0, largest = 0;
+
+    for (uint32_t b = first; b < refs.size(); ) {
+    	uint32_t run = freeRun(refs, b);
+    	free += run;
+    	largest = std::max(largest, run);
+    	b += run ? run : 1;
+    }
+
+    return free ? 1.0 - (double)largest / free : 0.0;
+}
+
+// First fit -------------------------------------------------------------------
+
+uint32_t FirstFit::allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home) {
+    for (uint32_t b = first; b < refs.size(); b++) {
+    	if (!refs[b]) {
+    	    return b;
+    	}
+    }
+
+    return 0;
+}
+
+// Next fit --------------------------------------------------------------------
+
+uint32_t NextFit::allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home) {
+    if (hint >= first && hint < refs.size() && !refs[hint]) {
+    	Cursor = hint + 1;
+    	return hint;
+    }
+
+    // Scan from the cursor, wrapping around once
+
+    size_t span = refs.size() - first;
+    uint32_t start = Cursor >= first && Cursor < refs.size() ? Cursor : first;
+
+    for (size_t i = 0; i < span; i++) {
+    	uint32_t b = first + (start - first + i) % span;
+    	if (!refs[b]) {
+    	    Cursor = b + 1;
+    	    return b;
+    	}
+    }
+
+    return 0;
+}
+
+// Best fit --------------------------------------------------------------------
+
+uint32_t BestFit::allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home) {
+    if (hint >= first && hint < refs.size() && !refs[hint]) {
+    	return hint;
+    }
+
+    // Smallest run that fits, else the largest run there is
+
+    uint32_t best = 0, bestRun = 0;
+    uint32_t largest = 0, largestRun = 0;
+
+    for (uint32_t b = first; b < refs.size(); ) {
+    	uint32_t run = freeRun(refs, b);
+    	if (!run) {
+    	    b++;
+    	    continue;
+    	}
+
+    	if (run >= want && (!bestRun || run < bestRun)) {
+    	    best = b;
+    	    bestRun = run;
+    	    if (run == want) {
+    	    	break;
+    	    }
+    	}
+    	if (run > largestRun) {
+    	    largest = b;
+    	    largestRun = run;
+    	}
+    	b += run;
+    }
+
+    return bestRun ? best : largest;
+}
+
+// Block groups ----------------------------------------------------------------
+
+void BlockGroups::bounds(const std::vector<uint32_t> &refs, uint32_t first, size_t group, uint32_t &start, uint32_t &end) {
+    size_t size = std::max((size_t)1, (refs.size() - first + GROUPS - 1) / GROUPS);
+
+    start = std::min(refs.size(), first + group*size);
+    end = std::min(refs.size(), start + size);
+}
+
+uint32_t BlockGroups::allocate(const std::vector<uint32_t> &refs, uint32_t first, uint32_t hint, uint32_t want, uint32_t home) {
+    if (hint >= first && hint < refs.size() && !refs[hint]) {
+    	return hint;
+    }
+
+    // Search the group holding the home block first, then the ones after it
+
+    size_t size = std::max((size_t)1, (refs.size() - first + GROUPS - 1) / GROUPS);
+    size_t group = home >= first && home < refs.size() ? (home - first) / size : 0;
+
+    for (size_t i = 0; i < GROUPS; i++) {
+    	uint32_t start, end;
+    	bounds(refs, first, (group + i) % GROUPS, start, end);
+
+    	for (uint32_t b = start; b < end; b++) {
+    	    if (!refs[b]) {
+    	    	return b;
+    	    }
+    	}
+    }
+
+    return 0;
+}
+
+double BlockGroups::fragmentation(const std::vector<uint32_t> &refs, uint32_t first) const {
+    double total = 0;
+    size_t groups = 0;
+
+    for (size_t g = 0; g < GROUPS; g++) {
+    	uint32_t start, end;
+    	bounds(refs, first, g, start, end);
+    	if (start >= end) {
+    	    continue;
+    	}
+
+    	// Measure the group as if it were a disk of its own
+
+    	std::vector<uint32_t> group(refs.begin() + start, refs.begin() + end);
+    	total += Allocator::fragmentation(group, 0);
+    	groups++;
+    }
+
+    return groups ? total / groups : 0.0;
+}
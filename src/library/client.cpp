@@ -0,0 +1,166 @@
+// client.cpp: Block server client
+
+#include "sfs/client.h"
+
+#include <cstring>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Client::~Client() {
+	if (Socket >= 0) {
+		close(Socket);
+	}
+}
+
+bool Client::connect(const char *path) {
+	struct sockaddr_un address;
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		return false;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (Socket < 0) {
+		return false;
+	}
+
+	if (::connect(Socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		close(Socket);
+		Socket = -1;
+		return false;
+	}
+
+	return true;
+}
+
+// FileSystem mirror -----------------------------------------------------------
+
+ssize_t Client::create() {
+	return submit(OP_CREATE, 0, nullptr, nullptr, 0, 0);
+}
+
+bool Client::remove(size_t inumber) {
+	return submit(OP_REMOVE, inumber, nullptr, nullptr, 0, 0) > 0 || Batching;
+}
+
+ssize_t Client::stat(size_t inumber) {
+	return submit(OP_STAT, inumber, nullptr, nullptr, 0, 0);
+}
+
+ssize_t Client::read(size_t inumber, char *data, size_t length, size_t offset) {
+	return submit(OP_READ, inumber, nullptr, data, length, offset);
+}
+
+ssize_t Client::write(size_t inumber, const char *data, size_t length, size_t offset) {
+	return submit(OP_WRITE, inumber, data, nullptr, length, offset);
+}
+
+// Batching --------------------------------------------------------------------
+
+void Client::begin() {
+	Batching = true;
+}
+
+std::vector<ssize_t> Client::commit() {
+	std::vector<ssize_t> results;
+	std::vector<Pending> queue;
+
+	queue.swap(Queue);
+	Batching = false;
+
+	// One send carries the whole batch; responses stream back in order
+
+	bool sent = sendAll(Outgoing.data(), Outgoing.size());
+	Outgoing.clear();
+	if (!sent) {
+		return results;
+	}
+
+	for (size_t i = 0; i < queue.size(); i++) {
+		Response response;
+		if (!recvAll((char *)&response, sizeof(response))) {
+			results.clear();
+			return results;
+		}
+
+		if (response.Length > 0 && (queue[i].data == nullptr || response.Length > queue[i].request.Length ||
+		    !recvAll(queue[i].data, response.Length))) {
+			results.clear();
+			return results;
+		}
+
+		results.push_back(response.Result);
+	}
+
+	return results;
+}
+
+// Internal helper functions ---------------------------------------------------
+
+ssize_t Client::submit(uint32_t op, size_t inumber, const char *data, char *buffer, size_t length, size_t offset) {
+	if (Socket < 0 || length > MAX_PAYLOAD) {
+		return -1;
+	}
+
+	Pending pending;
+	memset(&pending, 0, sizeof(pending));
+	pending.request.Op = op;
+	pending.request.Inumber = inumber;
+	pending.request.Length = length;
+	pending.request.Offset = offset;
+	pending.data = buffer;
+
+	Outgoing.insert(Outgoing.end(), (char *)&pending.request, (char *)&pending.request + sizeof(Request));
+	if (data != nullptr) {
+		Outgoing.insert(Outgoing.end(), data, data + length);
+	}
+	Queue.push_back(pending);
+
+	// Outside a batch every operation is a batch of one
+
+	if (Batching) {
+		return 0;
+	}
+
+	std::vector<ssize_t> results = commit();
+	return results.empty() ? -1 : results[0];
+}
+
+bool Client::sendAll(const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t sent = send(Socket, data, length, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+
+	return true;
+}
+
+bool Client::recvAll(char *data, size_t length) {
+	while (length > 0) {
+		ssize_t received = recv(Socket, data, length, 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		data += received;
+		length -= received;
+	}
+
+	return true;
+}
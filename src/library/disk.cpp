@@ -1,6 +1,7 @@
 // disk.cpp: disk emulator
 
 #include "sfs/disk.h"
+#include "sfs/trace.h"
 
 #include <stdexcept>
 
@@ -23,7 +24,9 @@ void Disk::open(const char *path, size_t nblocks) {
     	throw std::runtime_error(what);
     }
 
+    Bytes  = nblocks*BLOCK_SIZE;
     Blocks = nblocks;
+    BlockSize = BLOCK_SIZE;
     Reads  = 0;
     Writes = 0;
 }
@@ -37,6 +40,19 @@ Disk::~Disk() {
     }
 }
 
+bool Disk::setBlockSize(size_t size) {
+    if (size < BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1))) {
+    	return false;
+    }
+
+    // Count from the image length so a partial block left unused at one
+    // size comes back when regrouping to a smaller one
+
+    Blocks = Bytes / size;
+    BlockSize = size;
+    return true;
+}
+
 void Disk::sanity_check(int blocknum, void *data) {
     char what[BUFSIZ];
 
@@ -56,15 +72,17 @@ void Disk::sanity_check(int blocknum, void *data) {
 }
 
 void Disk::read(int blocknum, void *data) {
+    SFS_TRACE_SPAN("disk", "read");
+
     sanity_check(blocknum, data);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    if (lseek(FileDescriptor, (off_t)blocknum*BlockSize, SEEK_SET) < 0) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if (::read(FileDescriptor, data, BlockSize) != (ssize_t)BlockSize) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
@@ -74,15 +92,17 @@ void Disk::read(int blocknum, void *data) {
 }
 
 void Disk::write(int blocknum, void *data) {
+    SFS_TRACE_SPAN("disk", "write");
+
     sanity_check(blocknum, data);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    if (lseek(FileDescriptor, (off_t)blocknum*BlockSize, SEEK_SET) < 0) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if (::write(FileDescriptor, data, BlockSize) != (ssize_t)BlockSize) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
@@ -90,3 +110,45 @@ void Disk::write(int blocknum, void *data) {
 
     Writes++;
 }
+
+void Disk::read(int blocknum, size_t nblocks, void *data) {
+    SFS_TRACE_SPAN("disk", "read run");
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    sanity_check(blocknum, data);
+    sanity_check(blocknum + nblocks - 1, data);
+
+    // Whole runs go out as a single request
+
+    ssize_t length = nblocks*BlockSize;
+    if (pread(FileDescriptor, data, length, (off_t)blocknum*BlockSize) != length) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to read %d+%lu: %s", blocknum, nblocks, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    Reads += nblocks;
+}
+
+void Disk::write(int blocknum, size_t nblocks, void *data) {
+    SFS_TRACE_SPAN("disk", "write run");
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    sanity_check(blocknum, data);
+    sanity_check(blocknum + nblocks - 1, data);
+
+    ssize_t length = nblocks*BlockSize;
+    if (pwrite(FileDescriptor, data, length, (off_t)blocknum*BlockSize) != length) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to write %d+%lu: %s", blocknum, nblocks, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    Writes += nblocks;
+}
@@ -0,0 +1,93 @@
+// faulty.cpp: Fault-injecting disk for crash testing
+
+#include "sfs/faulty.h"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+
+void FaultyDisk::open(size_t nblocks) {
+    Durable.assign(nblocks*BLOCK_SIZE, 0);
+    Current = Durable;
+    Log.clear();
+
+    Bytes  = nblocks*BLOCK_SIZE;
+    Blocks = nblocks;
+    BlockSize = BLOCK_SIZE;
+    Reads  = 0;
+    Writes = 0;
+    Mounts = 0;
+}
+
+void FaultyDisk::sanity_check(int blocknum, size_t nblocks, void *data) {
+    Disk::sanity_check(blocknum, data);
+
+    if (blocknum + nblocks > Blocks) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "blocknum (%lu) is too big!", blocknum + nblocks - 1);
+    	throw std::invalid_argument(what);
+    }
+}
+
+void FaultyDisk::read(int blocknum, void *data) {
+    read(blocknum, 1, data);
+}
+
+void FaultyDisk::write(int blocknum, void *data) {
+    write(blocknum, 1, data);
+}
+
+void FaultyDisk::read(int blocknum, size_t nblocks, void *data) {
+    sanity_check(blocknum, nblocks, data);
+
+    memcpy(data, Current.data() + (size_t)blocknum*BlockSize, nblocks*BlockSize);
+    Reads += nblocks;
+}
+
+void FaultyDisk::write(int blocknum, size_t nblocks, void *data) {
+    sanity_check(blocknum, nblocks, data);
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	Write write;
+    	write.Offset = (blocknum + i)*BlockSize;
+    	write.Data.assign((char *)data + i*BlockSize, BlockSize);
+    	Log.push_back(write);
+    }
+
+    memcpy(&Current[(size_t)blocknum*BlockSize], data, nblocks*BlockSize);
+    Writes += nblocks;
+}
+
+void FaultyDisk::checkpoint() {
+    Durable = Current;
+    Log.clear();
+}
+
+void FaultyDisk::crash(size_t count, size_t torn, size_t reorder, unsigned seed) {
+    std::mt19937 random(seed);
+
+    count = std::min(count, Log.size());
+    reorder = std::min(reorder, count);
+
+    // Writes older than the cache window made it; cached ones survive by coin toss
+
+    for (size_t i = 0; i < count; i++) {
+    	const Write &write = Log[i];
+    	if (i >= count - reorder && random() % 2) {
+    	    continue;
+    	}
+
+    	size_t length = write.Data.size();
+    	if (torn && i == count - 1) {
+    	    length = std::min(length, torn*SECTOR_SIZE);
+    	}
+    	memcpy(&Durable[write.Offset], write.Data.data(), length);
+    }
+
+    Current = Durable;
+    Log.clear();
+    Mounts = 0;
+}
@@ -1,6 +1,7 @@
 // fs.cpp: File System
 
 #include "sfs/fs.h"
+#include "sfs/trace.h"
 
 #include <algorithm>
 
@@ -8,21 +9,44 @@
 #include <iostream>
 #include <cstring>
 #include <cmath>
+#include <ctime>
 
 // Debug file system -----------------------------------------------------------
 
 void FileSystem::debug(Disk *disk) {
 	Block block; 
+	char *buffer = new char [disk -> blockSize()];
+
 	// Read Superblock
-	disk -> read(0, block.Data);
+	disk -> read(0, buffer);
+	memcpy(&block, buffer, sizeof(block));
+
+	uint32_t bsize = block.Super.BlockSize ? block.Super.BlockSize : Disk::BLOCK_SIZE;
 
 	std::cout << "SuperBlock:" << std::endl;
 	if(block.Super.MagicNumber == FileSystem::MAGIC_NUMBER) 
 	{
 		std::cout << "magic number is valid" << std::endl;
 		std::cout << "\t" << block.Super.Blocks << " blocks" << std::endl;
-		std::cout << "\t" << block.Super.InodeBlocks << " inode blocks" << std::endl;
+		if(block.Super.InodeBlocks)
+		{
+			std::cout << "\t" << block.Super.InodeBlocks << " inode blocks" << std::endl;
+		}
+		else
+		{
+			std::cout << "\t" << "inode blocks allocated on demand" << std::endl;
+		}
 		std::cout << "\t" << block.Super.Inodes << " inodes" << std::endl;
+		std::cout << "\t" << (block.Super.InodeSize ? block.Super.InodeSize : LEGACY_INODE_SIZE) << " bytes per inode" << std::endl;
+		std::cout << "\t" << bsize << " bytes per block" << std::endl;
+
+		// Regroup the disk so the inode table reads back in whole blocks
+
+		if(bsize != disk -> blockSize() && disk -> setBlockSize(bsize))
+		{
+			delete [] buffer;
+			buffer = new char [bsize];
+		}
 	}
 	else 
 	{
@@ -31,31 +55,80 @@ void FileSystem::debug(Disk *disk) {
 
 	// Read Inode blocks
 
+	uint32_t isize = block.Super.InodeSize ? block.Super.InodeSize : LEGACY_INODE_SIZE;
+
+	// Dynamic inode blocks are listed in a pointer block
+
+	std::vector<uint32_t> iblocks;
+
 	for(uint32_t i = 1; i <= block.Super.InodeBlocks; i++)
 	{
+		iblocks.push_back(i);
+	}
+
+	if(!block.Super.InodeBlocks && block.Super.InodeTable)
+	{
+		disk -> read(block.Super.InodeTable, buffer);
 
-		Block iblock;
-		disk -> read(i, iblock.Data);
+		for(uint32_t i = 0; i < disk -> blockSize() / sizeof(uint32_t) && ((uint32_t *)buffer)[i]; i++)
+		{
+			iblocks.push_back(((uint32_t *)buffer)[i]);
+		}
+	}
+
+	for(uint32_t i = 1; i <= iblocks.size(); i++)
+	{
+
+		disk -> read(iblocks[i - 1], buffer);
 
-		for(uint32_t j = 0; j < FileSystem::INODES_PER_BLOCK; j++)
-		if(block.Inodes[i].Valid)
+		for(uint32_t j = 0; j < disk -> blockSize() / isize; j++)
 		{
-			std::cout << "Inode " << i * INODES_PER_BLOCK + j + 1 << ":" << std::endl;
-			std::cout << "\t" << "size: " << block.Inodes[j].Size << std::endl;
-			std::cout << "\t" << "direct blocks: " << ceil( 1.0 * block.Inodes[j].Size / Disk::BLOCK_SIZE ) << std::endl;
+			Inode inode = Inode();
+			memcpy(&inode, buffer + j * isize, isize);
+
+			if(inode.Valid)
+			{
+				std::cout << "Inode " << (i - 1) * (disk -> blockSize() / isize) + j << ":" << std::endl;
+				std::cout << "\t" << "size: " << inode.Size << " bytes" << std::endl;
+				if(inode.Valid & INODE_INLINE)
+				{
+					std::cout << "\t" << "inline data" << std::endl;
+				}
+				else
+				{
+					std::cout << "\t" << "direct blocks: " << ceil( 1.0 * inode.Size / disk -> blockSize() ) << std::endl;
+				}
+			}
 		}
 	}
+
+	delete [] buffer;
 }
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
+bool FileSystem::format(Disk *disk, size_t blockSize, uint32_t inodesPercent) {
+
+	SFS_TRACE_SPAN("fs", "format");
 
 	std::cout << "Beginning format..." << std::endl;
 
+	if(!disk -> setBlockSize(blockSize))
+	{
+		std::cout << "Block size " << blockSize << " unsupported!" << std::endl;
+		return false;
+	}
+
+	if(inodesPercent >= 100)
+	{
+		std::cout << "Inode share " << inodesPercent << "% leaves no data blocks!" << std::endl;
+		return false;
+	}
+
 	// Write superblock
 
 	Block block;
+	memset(&block, 0, sizeof(block));
 	std::cout << "Creating SuperBlock..." << std::endl;
 
 	std::cout << "Setting MagicNumber to " << FileSystem::MAGIC_NUMBER << std::endl; 
@@ -67,36 +140,38 @@ bool FileSystem::format(Disk *disk) {
 	std::cout << "Blocks set to " << disk -> size() << std::endl;
 
 
-	std::cout << "Setting InodeBlocks (" << INODES_PERCENT << "%) to " << disk -> size() / FileSystem::INODES_PERCENT << std::endl;
-	block.Super.InodeBlocks = disk -> size() / FileSystem::INODES_PERCENT;
+	// With no reserved share, inode blocks are taken from the data blocks as files are created
+
+	std::cout << "Setting InodeBlocks (" << inodesPercent << "%) to " << disk -> size() * inodesPercent / 100 << std::endl;
+	block.Super.InodeBlocks = disk -> size() * inodesPercent / 100;
 	std::cout << "InodeBlocks set to " << block.Super.InodeBlocks << std::endl;
 
 
-	std::cout << "Setting Inodes to " << block.Super.InodeBlocks * FileSystem::INODES_PER_BLOCK << std::endl;
-	block.Super.Inodes = block.Super.InodeBlocks * FileSystem::INODES_PER_BLOCK;
-	std::cout << "Set Inodes to " << block.Super.InodeBlocks * FileSystem::INODES_PER_BLOCK << std::endl;
+	uint32_t inodes = blockSize / FileSystem::INODE_SIZE;
+
+	std::cout << "Setting Inodes to " << block.Super.InodeBlocks * inodes << std::endl;
+	block.Super.Inodes = block.Super.InodeBlocks * inodes;
+	std::cout << "Set Inodes to " << block.Super.InodeBlocks * inodes << std::endl;
+
+	block.Super.InodeSize = FileSystem::INODE_SIZE;
+	block.Super.BlockSize = blockSize;
+
+	// Zeroed blocks are written in large runs so striped disks can work in parallel
+
+	size_t run = std::max((size_t)1, FileSystem::CLEAR_BLOCKS * Disk::BLOCK_SIZE / blockSize);
+	char *zero = new char [run * blockSize]();
 
 	std::cout << "Writing superblock to disk..." << std::endl;
-	disk -> Disk::write(0, &block.Data);
+	memcpy(zero, &block, sizeof(block));
+	disk -> write(0, zero);
+	memset(zero, 0, sizeof(block));
 	std::cout << "SuperBlock written..." << std::endl;
 
 	std::cout << "Writing inode table..." << std::endl;
-	for(uint32_t i = 1; i <= block.Super.InodeBlocks; i++)
+	for(size_t i = 1; i <= block.Super.InodeBlocks; i += run)
 	{
-		Block iblock;
-
-		// Make all blocks invalid and set all direct pointers to zero
-		for(uint32_t j = 0; j < FileSystem::INODES_PER_BLOCK; j++)
-		{
-			iblock.Inodes[j].Valid = 0;
-
-			for(uint32_t k = 0; k < FileSystem::POINTERS_PER_INODE; k++)
-			{
-				iblock.Inodes[j].Direct[k] = 0;
-			}
-		}
-
-		disk -> Disk::write(i, &iblock);
+		// Make all inodes invalid and set all pointers to zero
+		disk -> write(i, std::min(run, block.Super.InodeBlocks + 1 - i), zero);
 	}
 
 	std::cout << "Inode table written" << std::endl;
@@ -104,18 +179,21 @@ bool FileSystem::format(Disk *disk) {
 	// Clear all other blocks
 
 	std::cout << "Clearing remaining blocks..." << std::endl;
-	for(size_t i = 1 + block.Super.InodeBlocks; i < disk -> size(); i++)
+	for(size_t i = 1 + block.Super.InodeBlocks; i < disk -> size(); i += run)
 	{
-		char temp = 0;
-		disk -> Disk::write(i, &temp);
+		disk -> write(i, std::min(run, disk -> size() - i), zero);
 	}
 	std::cout << "Remaining blocks cleared" << std::endl;
+
+	delete [] zero;
 	return true;
 }
 
 // Mount file system -----------------------------------------------------------
 
-bool FileSystem::mount(Disk *disk) {
+bool FileSystem::mount(Disk *disk, ssize_t snapshot) {
+
+	SFS_TRACE_SPAN("fs", "mount");
 
 	if(disk -> mounted())
 	{
@@ -131,71 +209,162 @@ bool FileSystem::mount(Disk *disk) {
 	// Load SuperBlock into main memory
 
 	memSuperBlock = new Block;
-	disk -> read(0, memSuperBlock);
+
+	char *buffer = new char [disk -> blockSize()];
+	disk -> read(0, buffer);
+	memcpy(memSuperBlock, buffer, sizeof(Block));
+	delete [] buffer;
+
 	if(memSuperBlock -> Super.MagicNumber != FileSystem::MAGIC_NUMBER)
 	{
 		std::cout << "MagicNumber missing!" << std::endl;
+		disk -> unmount();
+		delete memSuperBlock;
 		return false;
 	}
 
-	// Load Inode array into main memory
+	// Regroup the disk into the block size chosen at format time
+
+	if(!disk -> setBlockSize(blockSize()) || memSuperBlock -> Super.Blocks > disk -> size())
+	{
+		std::cout << "Block size " << blockSize() << " unsupported by disk!" << std::endl;
+		disk -> unmount();
+		delete memSuperBlock;
+		return false;
+	}
+
+	// Values torn by a crash or read through the wrong disk geometry must
+	// not send the loaders past the end of the disk
+
+	if(!isSuperBlockValid())
+	{
+		std::cout << "SuperBlock corrupt!" << std::endl;
+		disk -> unmount();
+		delete memSuperBlock;
+		return false;
+	}
 
-	memInodes = new Inode [memSuperBlock -> Super.Inodes];
+	memBmap = new char [(size_t)(memSuperBlock -> Super.Blocks - memSuperBlock -> Super.InodeBlocks - 1) * blockSize()]();
+	memRefs.assign(memSuperBlock -> Super.Blocks, 0);
+
+	// Load Inode array into main memory
 
-	for(uint32_t i = 0; i < memSuperBlock -> Super.InodeBlocks; i++)
+	if(memSuperBlock -> Super.InodeBlocks)
 	{
+		memInodes = new Inode [memSuperBlock -> Super.Inodes]();
 
-		Block block;
-		disk -> read(i + 1, block.Data);
+		char *table = new char [(size_t)memSuperBlock -> Super.InodeBlocks * blockSize()];
+		disk -> read(1, memSuperBlock -> Super.InodeBlocks, table);
 
-		for(uint32_t j = 0; j < INODES_PER_BLOCK; j++)
+		for(uint32_t i = 0; i < memSuperBlock -> Super.InodeBlocks; i++)
 		{
-			memInodes[i * INODES_PER_BLOCK + j] = block.Inodes[j];
+			// Legacy images pack smaller inodes, so copy only the on-disk part
+
+			for(uint32_t j = 0; j < inodesPerBlock(); j++)
+			{
+				memcpy(&memInodes[i * inodesPerBlock() + j], table + (size_t)i * blockSize() + j * inodeSize(), inodeSize());
+				repairInode(&memInodes[i * inodesPerBlock() + j]);
+			}
+
 		}
 
+		delete [] table;
 	}
+	else if(memSuperBlock -> Super.InodeTable)
+	{
+		// Only the inode blocks handed out so far are read; inodes the
+		// table no longer lists are dropped
 
-	// Load blockmap into main memory by going through all the inodes
+		uint32_t blocks = readTable(disk, memSuperBlock -> Super.InodeTable);
+		if(blocks < inodeBlocks())
+		{
+			memSuperBlock -> Super.Inodes = blocks * inodesPerBlock();
+		}
+		memInodes = loadTable(memSuperBlock -> Super.InodeTable);
+	}
+	else
+	{
+		memInodes = new Inode [memSuperBlock -> Super.Inodes]();
+	}
 
-	memBmap = new Block [memSuperBlock -> Super.Blocks - memSuperBlock -> Super.InodeBlocks - 1];
+	// Load blockmap into main memory by going through all the inodes
 
 	loadMemBmap(disk);
 
+	if(!memAllocator)
+	{
+		memAllocator.reset(new FirstFit);
+	}
+
+	// Snapshots are mounted read-only in place of the live inode table
+
+	memReadOnly = false;
+
+	if(snapshot >= 0)
+	{
+		if(!memSuperBlock -> Super.Snapshots || snapshot >= SNAPSHOTS_PER_BLOCK ||
+		   !snapshotTable()[snapshot].Valid)
+		{
+			std::cout << "Snapshot " << snapshot << " missing!" << std::endl;
+			disk -> unmount();
+			delete memSuperBlock;
+			delete [] memInodes;
+			delete [] memBmap;
+			memRefs.clear();
+			return false;
+		}
+
+		delete [] memInodes;
+		memInodes = loadSnapshot(snapshot);
+		memReadOnly = true;
+	}
+
 	return true;
 }
 
 bool FileSystem::umount(Disk *disk) {
 
+	SFS_TRACE_SPAN("fs", "umount");
+
 	if(!disk -> mounted())
 	{
 		std::cout << "Already unmounted!" << std::endl;
 		return false;
 	}
 
-	// Flush SuperBlock to disk
+	// Snapshots are read-only, so there is nothing to flush
 
-	disk -> write(0, memSuperBlock);
+	if(!memReadOnly)
+	{
+		// Flush SuperBlock to disk
 
-	// Flush Inode array to disk
+		char *table = new char [(size_t)std::max(memSuperBlock -> Super.InodeBlocks, 1u) * blockSize()]();
 
-	for(uint32_t i = 0; i < memSuperBlock -> Super.InodeBlocks; i++)
-	{
+		memcpy(table, memSuperBlock, sizeof(Block));
+		disk -> write(0, table);
+		memset(table, 0, sizeof(Block));
 
-		Block block;
+		// Flush Inode array to disk; dynamic inode blocks go out with memBmap
 
-		for(uint32_t j = 0; j < FileSystem::INODES_PER_BLOCK; j++)
+		if(memSuperBlock -> Super.InodeTable)
 		{
-			block.Inodes[j] = memInodes[i * FileSystem::INODES_PER_BLOCK + j];
+			storeTable(memSuperBlock -> Super.InodeTable);
 		}
 
-		disk -> write(i + 1, block.Data);
-	}
+		for(uint32_t i = 0; i < memSuperBlock -> Super.InodeBlocks; i++)
+		{
+			for(uint32_t j = 0; j < inodesPerBlock(); j++)
+			{
+				memcpy(table + (size_t)i * blockSize() + j * inodeSize(), &memInodes[i * inodesPerBlock() + j], inodeSize());
+			}
+		}
 
-	// Flush blocks to disk
+		disk -> write(1, memSuperBlock -> Super.InodeBlocks, table);
+		delete [] table;
 
-	for(size_t i = 0; i < memSuperBlock -> Super.Blocks - memSuperBlock -> Super.InodeBlocks - 1; i++)
-	{
-		disk -> write(i + memSuperBlock -> Super.InodeBlocks + 1, memBmap[i].Data);
+		// Flush blocks to disk in one run
+
+		disk -> write(memSuperBlock -> Super.InodeBlocks + 1, memSuperBlock -> Super.Blocks - memSuperBlock -> Super.InodeBlocks - 1, memBmap);
 	}
 
 	// Set device and unmount
@@ -205,65 +374,105 @@ bool FileSystem::umount(Disk *disk) {
 	// Free in memory data structures
 
 	delete memSuperBlock;
-	delete memInodes;
-	delete memBmap;
+	delete [] memInodes;
+	delete [] memBmap;
+	memRefs.clear();
 
 	return true;
 }
 // Create inode ----------------------------------------------------------------
 ssize_t FileSystem::create() {
 
+	SFS_TRACE_SPAN("fs", "create");
+
+	if(memReadOnly)
+	{
+		return -1;
+	}
+
 	// Locate free inode in inode array
 
 	for(uint32_t i = 0; i < memSuperBlock -> Super.Inodes; i++)
 	{
 		if(!memInodes[i].Valid)
 		{
-			memInodes[i].Valid = 1;
-			memInodes[i].Size = 0;
-			for(uint32_t j = 0; j < POINTERS_PER_INODE; j++)
-			{
-				memInodes[i].Direct[j] = 0;
-			}
-			memInodes[i].Indirect = 0;
-			return i;
+			return create(i);
 		}
 	}
 
-	return -1;
+	// Dynamic inode tables grow by a block when they run out
+
+	uint32_t inumber = memSuperBlock -> Super.Inodes;
+
+	return growInodes() ? create(inumber) : -1;
 }
 
-// Remove inode ----------------------------------------------------------------
+ssize_t FileSystem::create(size_t inumber) {
 
-bool FileSystem::remove(size_t inumber) {
+	SFS_TRACE_SPAN("fs", "create");
 
-	if(!isInumberValid(inumber))
+	if(memReadOnly)
 	{
-		return false;
+		return -1;
 	}
 
-	// Clear inode in inode table
+	// Refuse what the table can never reach before growing it, and give back
+	// what was grown if the disk fills up on the way
 
-	memInodes[inumber].Size = 0;
-	memInodes[inumber].Valid = 0;
+	if(inumber >= memSuperBlock -> Super.Inodes &&
+	   (memSuperBlock -> Super.InodeBlocks || inumber >= (size_t)pointersPerBlock() * inodesPerBlock()))
+	{
+		return -1;
+	}
 
-	// Update blockmap
+	uint32_t table = memSuperBlock -> Super.InodeTable;
+	uint32_t blocks = inodeBlocks();
 
-	for(uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+	while(inumber >= memSuperBlock -> Super.Inodes)
+	{
+		if(!growInodes())
+		{
+			shrinkInodes(table, blocks);
+			return -1;
+		}
+	}
+
+	if(memInodes[inumber].Valid)
 	{
-		strcpy((memBmap[memInodes[inumber].Direct[i]]).Data, "\0");
+		return -1;
 	}
 
-	// Free direct blocks
+	memset(&memInodes[inumber], 0, sizeof(Inode));
+	memInodes[inumber].Valid = INODE_VALID;
 
-	for(uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+	// New files start inline and move to blocks once they outgrow the inode
+
+	if(inodeSize() >= INODE_SIZE)
+	{
+		memInodes[inumber].Valid |= INODE_INLINE;
+	}
+
+	return inumber;
+}
+
+// Remove inode ----------------------------------------------------------------
+
+bool FileSystem::remove(size_t inumber) {
+
+	SFS_TRACE_SPAN("fs", "remove");
+
+	if(memReadOnly || !isInumberValid(inumber))
 	{
-		memInodes[inumber].Direct[i] = 0;
+		return false;
 	}
 
-	// Free indirect blocks
+	// Release the blocks; ones still shared with snapshots stay behind
+
+	releaseInode(&memInodes[inumber]);
+
+	// Clear inode in inode table
 
-	memInodes[inumber].Indirect = 0;
+	memset(&memInodes[inumber], 0, sizeof(Inode));
 
 	return true;
 }
@@ -272,6 +481,8 @@ bool FileSystem::remove(size_t inumber) {
 
 ssize_t FileSystem::stat(size_t inumber) {
 
+	SFS_TRACE_SPAN("fs", "stat");
+
 	if(!isInumberValid(inumber))
 	{
 		return -1;
@@ -284,119 +495,1386 @@ ssize_t FileSystem::stat(size_t inumber) {
 
 ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
 
+	SFS_TRACE_SPAN("fs", "read");
+
 	if(!isInumberValid(inumber))
 	{
 		return -1;
 	}
 
-	// Load inode and initialize data
+	Inode *inode = &memInodes[inumber];
+
+	// Clamp read to the end of the file
+
+	if(offset >= inode -> Size)
+	{
+		return 0;
+	}
+
+	length = std::min(length, inode -> Size - offset);
 
-	uint32_t startPointer = offset / Disk::BLOCK_SIZE;
-	uint32_t endPointer = (offset + length) / Disk::BLOCK_SIZE;
-	uint32_t blocksRead = 0;
+	// Inline files are served straight from the inode table
 
-	data = 0;
+	if(inode -> Valid & INODE_INLINE)
+	{
+		memcpy(data, inode -> Inline + offset, length);
+		return length;
+	}
 
-	// Check for overflow
+	// Copy block by block
 
-	if(endPointer >= FileSystem::POINTERS_PER_INODE)
+	switch(blockSize())
 	{
-		endPointer = POINTERS_PER_INODE;
+		case 4096:	return readBlocks<4096>(inode, data, length, offset);
+		case 65536:	return readBlocks<65536>(inode, data, length, offset);
+		case 1 << 20:	return readBlocks<1 << 20>(inode, data, length, offset);
+		default:	return readBlocks<0>(inode, data, length, offset);
 	}
+}
+
+template <uint32_t BlockSize>
+ssize_t FileSystem::readBlocks(Inode *inode, char *data, size_t length, size_t offset) {
 
-	// Use temporary buffer to read blocks
+	// A constant block size turns the divisions into shifts and masks
 
-	char* buffer = new char [(endPointer - startPointer) * Disk::BLOCK_SIZE];
-	buffer = 0;
+	const size_t size = BlockSize ? BlockSize : blockSize();
 
-	for(uint32_t i = startPointer; i < endPointer; i++)
+	size_t bytesRead = 0;
+
+	while(bytesRead < length)
 	{
-		strcat(buffer, (memBmap[memInodes[inumber].Direct[i]]).Data);
-		blocksRead++;
-	}
+		uint32_t index = (offset + bytesRead) / size;
+		uint32_t blockOffset = (offset + bytesRead) % size;
+		size_t chunk = std::min(length - bytesRead, size - blockOffset);
+
+		uint32_t *pointer = getPointer(inode, index, false);
+
+		if(pointer && *pointer)
+		{
+			memcpy(data + bytesRead, dataBlock(*pointer) + blockOffset, chunk);
+		}
+		else
+		{
+			// Holes read back as zeros without touching memBmap
 
-	// Copy to required data, delete buffer and return blocksRead
+			memset(data + bytesRead, 0, chunk);
+		}
 
-	data = new char [length + 1]; // not freed - memory leak?
-	strncpy(data, buffer + (offset % Disk::BLOCK_SIZE), length);
-	delete buffer;
+		bytesRead += chunk;
+	}
 
-	return blocksRead;
+	return bytesRead;
 }
 
 // Write to inode --------------------------------------------------------------
 
 ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
 
-	if(!isInumberValid(inumber))
+	SFS_TRACE_SPAN("fs", "write");
+
+	if(memReadOnly || !isInumberValid(inumber))
 	{
 		return -1;
 	}
 
-	// Load inode and initialize data
+	// An empty write changes nothing; the block loop below needs at least one byte
 
-	uint32_t startPointer = offset / Disk::BLOCK_SIZE;
-	uint32_t endPointer = (offset + length) / Disk::BLOCK_SIZE;
-	uint32_t blocksWritten = Disk::BLOCK_SIZE * (endPointer - startPointer) + (Disk::BLOCK_SIZE - offset);
+	if(length == 0)
+	{
+		return 0;
+	}
 
-	data = 0;
+	Inode *inode = &memInodes[inumber];
 
 	// Check for overflow
 
-	if(endPointer >= FileSystem::POINTERS_PER_INODE)
+	size_t maxSize = maxFileSize();
+
+	if(offset >= maxSize)
+	{
+		return -1;
+	}
+
+	length = std::min(length, maxSize - offset);
+
+	// Small files stay inline; anything larger moves out to data blocks
+
+	if(inode -> Valid & INODE_INLINE)
 	{
-		endPointer = POINTERS_PER_INODE;
+		if(offset + length <= INLINE_SIZE)
+		{
+			memcpy(inode -> Inline + offset, data, length);
+			inode -> Size = std::max((size_t)inode -> Size, offset + length);
+			return length;
+		}
+
+		if(!spillInline(inode))
+		{
+			return -1;
+		}
 	}
 
 	// Write blocks to memBmap
 
-	for(uint32_t i = startPointer; i < endPointer; i++)
+	ssize_t bytesWritten;
+
+	switch(blockSize())
 	{
-		strcpy((memBmap[memInodes[inumber].Direct[i]]).Data, data + Disk::BLOCK_SIZE * (i - startPointer) - offset);
+		case 4096:	bytesWritten = writeBlocks<4096>(inode, data, length, offset); break;
+		case 65536:	bytesWritten = writeBlocks<65536>(inode, data, length, offset); break;
+		case 1 << 20:	bytesWritten = writeBlocks<1 << 20>(inode, data, length, offset); break;
+		default:	bytesWritten = writeBlocks<0>(inode, data, length, offset); break;
 	}
 
-	return blocksWritten;
+	inode -> Size = std::max((size_t)inode -> Size, offset + bytesWritten);
+
+	return bytesWritten ? bytesWritten : -1;
 }
 
-// Internal helper functions --------------------------------------------------
+template <uint32_t BlockSize>
+ssize_t FileSystem::writeBlocks(Inode *inode, char *data, size_t length, size_t offset) {
 
-bool FileSystem::isInumberValid(size_t inumber)
-{
-	// Out-of-bounds checks
+	const size_t size = BlockSize ? BlockSize : blockSize();
 
-	if(inumber < 0 || inumber >= memSuperBlock -> Super.Inodes)
+	// Only the blocks touched by the write are allocated; anything skipped stays a hole
+
+	uint32_t lastIndex = (offset + length - 1) / size;
+
+	size_t bytesWritten = 0;
+
+	for(uint32_t i = offset / size; i <= lastIndex; i++)
+	{
+		uint32_t *pointer = getPointer(inode, i, true, lastIndex - i + 1);
+
+		if(!pointer)
+		{
+			break;
+		}
+
+		uint32_t blockOffset = (offset + bytesWritten) % size;
+		size_t chunk = std::min(length - bytesWritten, size - blockOffset);
+
+		memcpy(dataBlock(*pointer) + blockOffset, data + bytesWritten, chunk);
+		bytesWritten += chunk;
+	}
+
+	return bytesWritten;
+}
+
+// Truncate inode -------------------------------------------------------------
+
+bool FileSystem::truncate(size_t inumber, size_t size) {
+
+	SFS_TRACE_SPAN("fs", "truncate");
+
+	if(memReadOnly || !isInumberValid(inumber))
 	{
-		std::cout << "Error: inumber = "<< inumber << " out of bounds" << std::endl;
 		return false;
 	}
 
-	// Check for invalid inode
+	Inode *inode = &memInodes[inumber];
 
-	if(!memInodes[inumber].Valid)
+	if(size > maxFileSize())
+	{
+		return false;
+	}
+
+	size_t bsize = blockSize();
+
+	if(inode -> Valid & INODE_INLINE)
+	{
+		if(size <= INLINE_SIZE)
+		{
+			if(size < inode -> Size)
+			{
+				memset(inode -> Inline + size, 0, inode -> Size - size);
+			}
+			inode -> Size = size;
+			return true;
+		}
+
+		if(!spillInline(inode))
+		{
+			return false;
+		}
+	}
+
+	// Zero the tail of a partial last block so growing again reads zeros;
+	// shared blocks are copied before anything is released, so running out
+	// of space leaves the file untouched
+
+	uint32_t keep = (size + bsize - 1) / bsize;
+
+	if(inode -> Indirect && keep > POINTERS_PER_INODE && !unshareIndirect(inode))
 	{
-		std::cout << "Error: inumber " << inumber << " invalid" << std::endl;
 		return false;
 	}
 
+	uint32_t *pointer = getPointer(inode, size / bsize, false);
+
+	if(size < inode -> Size && size % bsize && pointer && *pointer)
+	{
+		if(!(pointer = getPointer(inode, size / bsize, true)))
+		{
+			return false;
+		}
+		memset(dataBlock(*pointer) + size % bsize, 0, bsize - size % bsize);
+	}
+
+	// Release whole blocks past the new end; growing just leaves a hole
+
+	for(uint32_t i = keep; i < POINTERS_PER_INODE; i++)
+	{
+		freeBlock(inode -> Direct[i]);
+		inode -> Direct[i] = 0;
+	}
+
+	if(inode -> Indirect && keep <= POINTERS_PER_INODE)
+	{
+		freeIndirect(inode -> Indirect);
+		inode -> Indirect = 0;
+	}
+	else if(inode -> Indirect)
+	{
+		for(uint32_t i = keep - POINTERS_PER_INODE; i < pointersPerBlock(); i++)
+		{
+			freeBlock(pointerBlock(inode -> Indirect)[i]);
+			pointerBlock(inode -> Indirect)[i] = 0;
+		}
+	}
+
+	inode -> Size = size;
+
 	return true;
 }
 
-uint32_t FileSystem::getBlockNumber(size_t inumber)
-{
-	return inumber / FileSystem::INODES_PER_BLOCK + 1;
-}
+// Next inode ------------------------------------------------------------------
 
-void FileSystem::loadMemBmap(Disk *disk)
-{
-	for(uint32_t i = 0; i < memSuperBlock -> Super.Inodes; i++)
+ssize_t FileSystem::nextInode(size_t inumber) {
+
+	for(size_t i = inumber; i < memSuperBlock -> Super.Inodes; i++)
 	{
-		for(uint32_t j = 0; j < FileSystem::POINTERS_PER_INODE; j++)
+		if(memInodes[i].Valid)
 		{
-
-			if(memInodes[i].Direct[j])
-			{
-				disk -> read(memInodes[i].Direct[j], (memBmap[memInodes[i].Direct[j]]).Data);
-			}
+			return i;
 		}
 	}
+
+	return -1;
+}
+
+// Seek data / hole ----------------------------------------------------------
+
+ssize_t FileSystem::seekData(size_t inumber, size_t offset) {
+
+	SFS_TRACE_SPAN("fs", "seekData");
+
+	if(!isInumberValid(inumber))
+	{
+		return -1;
+	}
+
+	Inode *inode = &memInodes[inumber];
+
+	if(offset >= inode -> Size)
+	{
+		return -1;
+	}
+
+	if(inode -> Valid & INODE_INLINE)
+	{
+		return offset;
+	}
+
+	// Find the first backed block at or after offset
+
+	size_t bsize = blockSize();
+
+	for(uint32_t i = offset / bsize; (size_t)i * bsize < inode -> Size; i++)
+	{
+		uint32_t *pointer = getPointer(inode, i, false);
+
+		if(!pointer)
+		{
+			break;
+		}
+
+		if(*pointer)
+		{
+			return std::max(offset, (size_t)i * bsize);
+		}
+	}
+
+	return -1;
+}
+
+ssize_t FileSystem::seekHole(size_t inumber, size_t offset) {
+
+	SFS_TRACE_SPAN("fs", "seekHole");
+
+	if(!isInumberValid(inumber))
+	{
+		return -1;
+	}
+
+	Inode *inode = &memInodes[inumber];
+
+	if(offset >= inode -> Size)
+	{
+		return -1;
+	}
+
+	if(inode -> Valid & INODE_INLINE)
+	{
+		return inode -> Size;
+	}
+
+	// Find the first unbacked block at or after offset; end of file counts as a hole
+
+	size_t bsize = blockSize();
+
+	for(uint32_t i = offset / bsize; (size_t)i * bsize < inode -> Size; i++)
+	{
+		uint32_t *pointer = getPointer(inode, i, false);
+
+		if(!pointer || !*pointer)
+		{
+			return std::max(offset, (size_t)i * bsize);
+		}
+	}
+
+	return inode -> Size;
+}
+
+// Clone inode ----------------------------------------------------------------
+
+ssize_t FileSystem::clone(size_t inumber) {
+
+	SFS_TRACE_SPAN("fs", "clone");
+
+	if(memReadOnly || !isInumberValid(inumber))
+	{
+		return -1;
+	}
+
+	ssize_t copy = create();
+	if(copy < 0)
+	{
+		return -1;
+	}
+
+	// The clone shares every block with the source until one of them writes
+
+	memInodes[copy] = memInodes[inumber];
+	shareInode(&memInodes[copy]);
+
+	return copy;
+}
+
+// Snapshots ------------------------------------------------------------------
+
+ssize_t FileSystem::snapshot() {
+
+	SFS_TRACE_SPAN("fs", "snapshot");
+
+	if(memReadOnly)
+	{
+		return -1;
+	}
+
+	// The frozen table is listed in at most one level of pointer blocks past the first
+
+	if(inodeBlocks() > pointersPerBlock() * (pointersPerBlock() + 1))
+	{
+		std::cout << "Inode table too large to snapshot!" << std::endl;
+		return -1;
+	}
+
+	if(!memSuperBlock -> Super.Snapshots && !(memSuperBlock -> Super.Snapshots = allocateBlock()))
+	{
+		return -1;
+	}
+
+	Snapshot *snapshots = snapshotTable();
+
+	uint32_t s = 0;
+	while(s < SNAPSHOTS_PER_BLOCK && snapshots[s].Valid)
+	{
+		s++;
+	}
+
+	if(s == SNAPSHOTS_PER_BLOCK)
+	{
+		return -1;
+	}
+
+	// Copy only the inode blocks holding valid inodes into fresh blocks;
+	// the rest of the table reads back as free inodes
+
+	Snapshot *entry = &snapshots[s];
+
+	if(!(entry -> Table = allocateBlock()))
+	{
+		return -1;
+	}
+
+	for(uint32_t i = 0; i < inodeBlocks(); i++)
+	{
+		Inode *first = &memInodes[i * inodesPerBlock()];
+		if(std::none_of(first, first + inodesPerBlock(), [](const Inode &inode) { return inode.Valid; }))
+		{
+			continue;
+		}
+
+		uint32_t *pointer = frozenPointer(entry, i, true);
+		if(!pointer || !(*pointer = allocateBlock()))
+		{
+			std::cout << "Out of space for the frozen inode table!" << std::endl;
+			freeFrozen(entry);
+			return -1;
+		}
+
+		packInodes(i, *pointer);
+	}
+
+	// Every block the frozen inodes point at gains an owner; no data is copied
+
+	for(uint32_t i = 0; i < memSuperBlock -> Super.Inodes; i++)
+	{
+		shareInode(&memInodes[i]);
+	}
+
+	entry -> Valid = 1;
+	entry -> Created = time(nullptr);
+
+	return s;
+}
+
+void FileSystem::snapshots() {
+
+	uint32_t count = 0;
+
+	if(memSuperBlock -> Super.Snapshots)
+	{
+		Snapshot *snapshots = snapshotTable();
+
+		for(uint32_t i = 0; i < SNAPSHOTS_PER_BLOCK; i++)
+		{
+			if(!snapshots[i].Valid)
+			{
+				continue;
+			}
+
+			char created[BUFSIZ];
+			time_t when = snapshots[i].Created;
+			strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+
+			std::cout << "Snapshot " << i << ":" << std::endl;
+			std::cout << "\t" << "created: " << created << std::endl;
+			count++;
+		}
+	}
+
+	std::cout << count << " snapshots" << std::endl;
+}
+
+bool FileSystem::removeSnapshot(size_t snapshot) {
+
+	SFS_TRACE_SPAN("fs", "removeSnapshot");
+
+	if(memReadOnly || !memSuperBlock -> Super.Snapshots || snapshot >= SNAPSHOTS_PER_BLOCK)
+	{
+		return false;
+	}
+
+	Snapshot *entry = &snapshotTable()[snapshot];
+
+	if(!entry -> Valid)
+	{
+		return false;
+	}
+
+	// Drop the frozen inodes' references, then the frozen table itself
+
+	Inode *inodes = loadSnapshot(snapshot);
+	for(uint32_t i = 0; i < memSuperBlock -> Super.Inodes; i++)
+	{
+		releaseInode(&inodes[i]);
+	}
+	delete [] inodes;
+
+	freeFrozen(entry);
+
+	return true;
+}
+
+// Allocation policy ----------------------------------------------------------
+
+bool FileSystem::setPolicy(const char *name) {
+
+	Allocator *allocator = Allocator::create(name);
+
+	if(!allocator)
+	{
+		return false;
+	}
+
+	memAllocator.reset(allocator);
+
+	return true;
+}
+
+const char *FileSystem::policy() {
+
+	return memAllocator ? memAllocator -> name() : "first-fit";
+}
+
+double FileSystem::fileFragmentation() {
+
+	// Count neighbouring file blocks that are also neighbours on disk
+
+	size_t pairs = 0, breaks = 0;
+
+	for(uint32_t i = 0; i < memSuperBlock -> Super.Inodes; i++)
+	{
+		Inode *inode = &memInodes[i];
+
+		if(!inode -> Valid || (inode -> Valid & INODE_INLINE))
+		{
+			continue;
+		}
+
+		uint32_t previous = BLOCK_UNSET;
+
+		for(uint32_t j = 0; (size_t)j * blockSize() < inode -> Size; j++)
+		{
+			uint32_t *pointer = getPointer(inode, j, false);
+			uint32_t blocknum = pointer ? *pointer : BLOCK_UNSET;
+
+			if(previous && blocknum)
+			{
+				pairs++;
+				breaks += blocknum != previous + 1;
+			}
+
+			previous = blocknum;
+		}
+	}
+
+	return pairs ? (double)breaks / pairs : 0.0;
+}
+
+double FileSystem::freeFragmentation() {
+
+	return memAllocator -> fragmentation(memRefs, memSuperBlock -> Super.InodeBlocks + 1);
+}
+
+// Defragment inode -----------------------------------------------------------
+
+ssize_t FileSystem::defrag(size_t inumber, size_t &moved) {
+
+	SFS_TRACE_SPAN("fs", "defrag");
+
+	moved = 0;
+
+	ssize_t next = nextInode(inumber);
+
+	if(memReadOnly || next < 0)
+	{
+		return -1;
+	}
+
+	Inode *inode = &memInodes[next];
+
+	if(inode -> Valid & INODE_INLINE)
+	{
+		return next;
+	}
+
+	// Gather the backed blocks in file order; shared ones would need every owner updated
+
+	std::vector<uint32_t *> pointers;
+	bool fragmented = false;
+
+	if(inode -> Indirect && memRefs[inode -> Indirect] > 1)
+	{
+		return next;
+	}
+
+	for(uint32_t i = 0; (size_t)i * blockSize() < inode -> Size; i++)
+	{
+		uint32_t *pointer = getPointer(inode, i, false);
+
+		if(!pointer || !*pointer)
+		{
+			continue;
+		}
+
+		if(memRefs[*pointer] > 1)
+		{
+			return next;
+		}
+
+		fragmented |= !pointers.empty() && *pointer != *pointers.back() + 1;
+		pointers.push_back(pointer);
+	}
+
+	if(!fragmented)
+	{
+		return next;
+	}
+
+	// Runs low on the disk are preferred, which compacts free space toward the end
+
+	uint32_t start = findRun(pointers.size());
+
+	if(start == BLOCK_UNSET)
+	{
+		return next;
+	}
+
+	// Pointers change as each block lands, so the file reads back the same throughout
+
+	for(size_t i = 0; i < pointers.size(); i++)
+	{
+		memcpy(dataBlock(start + i), dataBlock(*pointers[i]), blockSize());
+		memRefs[start + i] = 1;
+		freeBlock(*pointers[i]);
+		*pointers[i] = start + i;
+	}
+
+	moved = pointers.size();
+
+	return next;
+}
+
+// Internal helper functions --------------------------------------------------
+
+bool FileSystem::isInumberValid(size_t inumber)
+{
+	// Out-of-bounds checks
+
+	if(inumber < 0 || inumber >= memSuperBlock -> Super.Inodes)
+	{
+		std::cout << "Error: inumber = "<< inumber << " out of bounds" << std::endl;
+		return false;
+	}
+
+	// Check for invalid inode
+
+	if(!memInodes[inumber].Valid)
+	{
+		std::cout << "Error: inumber " << inumber << " invalid" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool FileSystem::isBlockValid(uint32_t blocknum)
+{
+	// Only blocks after the inode table hold data, pointers and tables
+
+	return blocknum > memSuperBlock -> Super.InodeBlocks && blocknum < memSuperBlock -> Super.Blocks;
+}
+
+bool FileSystem::isSuperBlockValid()
+{
+	SuperBlock &super = memSuperBlock -> Super;
+
+	if(super.InodeBlocks >= super.Blocks || (super.InodeSize && super.InodeSize != INODE_SIZE))
+	{
+		return false;
+	}
+
+	if(super.Snapshots && !isBlockValid(super.Snapshots))
+	{
+		return false;
+	}
+
+	// Reserved tables are full; tables grown on demand fit in one pointer block
+
+	if(super.InodeBlocks)
+	{
+		return super.Inodes == super.InodeBlocks * inodesPerBlock() && !super.InodeTable;
+	}
+
+	if(super.Inodes % inodesPerBlock() || inodeBlocks() > pointersPerBlock())
+	{
+		return false;
+	}
+
+	return super.InodeTable ? isBlockValid(super.InodeTable) : !super.Inodes;
+}
+
+void FileSystem::repairInode(Inode *inode)
+{
+	// Inodes damaged by a crash lose pointers outside the disk instead of
+	// reaching past memBmap; unknown flags mean the inode was never valid
+
+	if((inode -> Valid & ~(INODE_VALID | INODE_INLINE)) || !(inode -> Valid & INODE_VALID))
+	{
+		memset(inode, 0, sizeof(Inode));
+		return;
+	}
+
+	if(inode -> Valid & INODE_INLINE)
+	{
+		inode -> Size = std::min(inode -> Size, (uint32_t)INLINE_SIZE);
+		return;
+	}
+
+	inode -> Size = std::min((size_t)inode -> Size, maxFileSize());
+
+	for(uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		if(inode -> Direct[i] && !isBlockValid(inode -> Direct[i]))
+		{
+			inode -> Direct[i] = 0;
+		}
+	}
+
+	if(inode -> Indirect && !isBlockValid(inode -> Indirect))
+	{
+		inode -> Indirect = 0;
+	}
+}
+
+uint32_t FileSystem::getBlockNumber(size_t inumber)
+{
+	return inumber / inodesPerBlock() + 1;
+}
+
+void FileSystem::loadMemBmap(Disk *disk)
+{
+	// Superblock and inode table are always in use
+
+	for(uint32_t i = 0; i <= memSuperBlock -> Super.InodeBlocks; i++)
+	{
+		memRefs[i] = 1;
+	}
+
+	for(uint32_t i = 0; i < memSuperBlock -> Super.Inodes; i++)
+	{
+		referenceInode(disk, &memInodes[i]);
+	}
+
+	// Snapshots hold references of their own through frozen inode tables
+
+	if(!memSuperBlock -> Super.Snapshots)
+	{
+		return;
+	}
+
+	Snapshot *snapshots = snapshotTable();
+	disk -> read(memSuperBlock -> Super.Snapshots, snapshots);
+	memRefs[memSuperBlock -> Super.Snapshots] = 1;
+
+	for(uint32_t i = 0; i < SNAPSHOTS_PER_BLOCK; i++)
+	{
+		if(snapshots[i].Valid && (!isBlockValid(snapshots[i].Table) ||
+		   (snapshots[i].Extra && !isBlockValid(snapshots[i].Extra))))
+		{
+			snapshots[i].Valid = 0;
+		}
+
+		if(!snapshots[i].Valid)
+		{
+			continue;
+		}
+
+		readTable(disk, snapshots[i].Table);
+
+		if(snapshots[i].Extra)
+		{
+			readTable(disk, snapshots[i].Extra);
+
+			for(uint32_t j = 0; j < pointersPerBlock(); j++)
+			{
+				if(pointerBlock(snapshots[i].Extra)[j])
+				{
+					readTable(disk, pointerBlock(snapshots[i].Extra)[j]);
+				}
+			}
+		}
+
+		Inode *inodes = loadSnapshot(i);
+		for(uint32_t j = 0; j < memSuperBlock -> Super.Inodes; j++)
+		{
+			referenceInode(disk, &inodes[j]);
+		}
+		delete [] inodes;
+	}
+}
+
+uint32_t FileSystem::inodeSize()
+{
+	return memSuperBlock -> Super.InodeSize ? memSuperBlock -> Super.InodeSize : LEGACY_INODE_SIZE;
+}
+
+uint32_t FileSystem::inodesPerBlock()
+{
+	return blockSize() / inodeSize();
+}
+
+uint32_t FileSystem::inodeBlocks()
+{
+	return memSuperBlock -> Super.Inodes / inodesPerBlock();
+}
+
+bool FileSystem::growInodes()
+{
+	// Only tables without reserved blocks can grow, one pointer block's worth at most
+
+	if(memSuperBlock -> Super.InodeBlocks || inodeBlocks() >= pointersPerBlock())
+	{
+		return false;
+	}
+
+	if(!memSuperBlock -> Super.InodeTable && !(memSuperBlock -> Super.InodeTable = allocateBlock()))
+	{
+		return false;
+	}
+
+	// Inode blocks are spread over the disk in bit-reversed order of their
+	// index, so each lands far from the others with room for its files nearby
+
+	uint32_t reversed = 0;
+	for(uint32_t i = 0; i < 32; i++)
+	{
+		reversed = (reversed << 1) | ((inodeBlocks() >> i) & 1);
+	}
+
+	uint32_t home = 1 + ((uint64_t)reversed * (memSuperBlock -> Super.Blocks - 1) >> 32);
+	uint32_t blocknum = allocateBlock(home, 1, home);
+	if(!blocknum)
+	{
+		return false;
+	}
+
+	pointerBlock(memSuperBlock -> Super.InodeTable)[inodeBlocks()] = blocknum;
+
+	Inode *inodes = new Inode [memSuperBlock -> Super.Inodes + inodesPerBlock()]();
+	std::copy(memInodes, memInodes + memSuperBlock -> Super.Inodes, inodes);
+	delete [] memInodes;
+
+	memInodes = inodes;
+	memSuperBlock -> Super.Inodes += inodesPerBlock();
+
+	return true;
+}
+
+void FileSystem::shrinkInodes(uint32_t table, uint32_t blocks)
+{
+	// Undo growInodes back to an earlier table; the inodes dropped are unused
+
+	while(inodeBlocks() > blocks)
+	{
+		uint32_t *pointers = pointerBlock(memSuperBlock -> Super.InodeTable);
+		freeBlock(pointers[inodeBlocks() - 1]);
+		pointers[inodeBlocks() - 1] = 0;
+		memSuperBlock -> Super.Inodes -= inodesPerBlock();
+	}
+
+	if(!table && memSuperBlock -> Super.InodeTable)
+	{
+		freeBlock(memSuperBlock -> Super.InodeTable);
+		memSuperBlock -> Super.InodeTable = 0;
+	}
+}
+
+uint32_t FileSystem::blockSize()
+{
+	return memSuperBlock -> Super.BlockSize ? memSuperBlock -> Super.BlockSize : Disk::BLOCK_SIZE;
+}
+
+uint32_t FileSystem::pointersPerBlock()
+{
+	return blockSize() / sizeof(uint32_t);
+}
+
+size_t FileSystem::maxFileSize()
+{
+	// Large blocks can address more than the 32-bit Size field holds
+
+	return std::min((size_t)UINT32_MAX, (size_t)(POINTERS_PER_INODE + pointersPerBlock()) * blockSize());
+}
+
+char *FileSystem::dataBlock(uint32_t blocknum)
+{
+	// memBmap only covers the blocks after the inode table
+
+	return memBmap + (size_t)(blocknum - memSuperBlock -> Super.InodeBlocks - 1) * blockSize();
+}
+
+uint32_t *FileSystem::pointerBlock(uint32_t blocknum)
+{
+	return (uint32_t *)dataBlock(blocknum);
+}
+
+FileSystem::Snapshot *FileSystem::snapshotTable()
+{
+	return (Snapshot *)dataBlock(memSuperBlock -> Super.Snapshots);
+}
+
+uint32_t FileSystem::homeBlock(size_t inumber)
+{
+	// Data belongs near its inode: inode blocks taken on demand have a place
+	// on disk, while a reserved table maps proportionally onto the blocks after it
+
+	uint32_t first = memSuperBlock -> Super.InodeBlocks + 1;
+
+	if(!memSuperBlock -> Super.InodeBlocks)
+	{
+		return memSuperBlock -> Super.InodeTable && inumber < memSuperBlock -> Super.Inodes ?
+		       pointerBlock(memSuperBlock -> Super.InodeTable)[inumber / inodesPerBlock()] : 0;
+	}
+
+	return first + (uint64_t)inumber * (memSuperBlock -> Super.Blocks - first) / memSuperBlock -> Super.Inodes;
+}
+
+uint32_t FileSystem::allocateBlock(uint32_t hint, uint32_t want, uint32_t home)
+{
+	// The policy picks among the blocks after the inode table
+
+	uint32_t blocknum = memAllocator -> allocate(memRefs, memSuperBlock -> Super.InodeBlocks + 1, hint, want, home);
+
+	if(blocknum != BLOCK_UNSET)
+	{
+		memRefs[blocknum] = 1;
+		memset(dataBlock(blocknum), 0, blockSize());
+	}
+
+	return blocknum;
+}
+
+void FileSystem::freeBlock(uint32_t blocknum)
+{
+	// Blocks shared with snapshots survive until the last reference goes
+
+	if(blocknum == BLOCK_UNSET || --memRefs[blocknum])
+	{
+		return;
+	}
+
+	memset(dataBlock(blocknum), 0, blockSize());
+}
+
+void FileSystem::freeIndirect(uint32_t blocknum)
+{
+	if(blocknum == BLOCK_UNSET)
+	{
+		return;
+	}
+
+	// Children are referenced once by the pointer block, not by each of its owners
+
+	if(memRefs[blocknum] == 1)
+	{
+		for(uint32_t i = 0; i < pointersPerBlock(); i++)
+		{
+			freeBlock(pointerBlock(blocknum)[i]);
+		}
+	}
+
+	freeBlock(blocknum);
+}
+
+uint32_t FileSystem::copyBlock(uint32_t blocknum, uint32_t hint, uint32_t home)
+{
+	uint32_t copy = allocateBlock(hint, 1, home);
+
+	if(copy)
+	{
+		memcpy(dataBlock(copy), dataBlock(blocknum), blockSize());
+		freeBlock(blocknum);
+	}
+
+	return copy;
+}
+
+void FileSystem::referenceInode(Disk *disk, Inode *inode)
+{
+	// Load each block the first time it is referenced
+
+	if(!inode -> Valid || (inode -> Valid & INODE_INLINE))
+	{
+		return;
+	}
+
+	std::vector<uint32_t> blocks;
+
+	for(uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		if(inode -> Direct[i] && !memRefs[inode -> Direct[i]]++)
+		{
+			blocks.push_back(inode -> Direct[i]);
+		}
+	}
+
+	if(inode -> Indirect && !memRefs[inode -> Indirect]++)
+	{
+		uint32_t *indirect = pointerBlock(inode -> Indirect);
+		disk -> read(inode -> Indirect, indirect);
+
+		for(uint32_t i = 0; i < pointersPerBlock(); i++)
+		{
+			if(indirect[i] && !isBlockValid(indirect[i]))
+			{
+				indirect[i] = 0;
+			}
+
+			if(indirect[i] && !memRefs[indirect[i]]++)
+			{
+				blocks.push_back(indirect[i]);
+			}
+		}
+	}
+
+	loadBlocks(disk, blocks);
+}
+
+void FileSystem::loadBlocks(Disk *disk, const std::vector<uint32_t> &blocks)
+{
+	// Blocks laid out contiguously on disk are read with one request per run
+
+	for(size_t i = 0; i < blocks.size(); )
+	{
+		size_t run = 1;
+		while(i + run < blocks.size() && blocks[i + run] == blocks[i] + run)
+		{
+			run++;
+		}
+
+		disk -> read(blocks[i], run, dataBlock(blocks[i]));
+		i += run;
+	}
+}
+
+void FileSystem::shareInode(Inode *inode)
+{
+	// Pointer blocks are shared whole, so only top-level blocks gain a reference
+
+	if(!inode -> Valid || (inode -> Valid & INODE_INLINE))
+	{
+		return;
+	}
+
+	for(uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		if(inode -> Direct[i])
+		{
+			memRefs[inode -> Direct[i]]++;
+		}
+	}
+
+	if(inode -> Indirect)
+	{
+		memRefs[inode -> Indirect]++;
+	}
+}
+
+void FileSystem::releaseInode(Inode *inode)
+{
+	if(!inode -> Valid || (inode -> Valid & INODE_INLINE))
+	{
+		return;
+	}
+
+	for(uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		freeBlock(inode -> Direct[i]);
+	}
+
+	freeIndirect(inode -> Indirect);
+}
+
+FileSystem::Inode *FileSystem::loadSnapshot(size_t snapshot)
+{
+	// Blocks the frozen table skips held no valid inodes, and tables frozen
+	// before a dynamic table grew come back short; both read as free inodes
+
+	Snapshot *entry = &snapshotTable()[snapshot];
+	Inode *inodes = new Inode [memSuperBlock -> Super.Inodes]();
+
+	for(uint32_t i = 0; i < inodeBlocks(); i++)
+	{
+		uint32_t *pointer = frozenPointer(entry, i, false);
+		if(pointer && *pointer)
+		{
+			unpackInodes(inodes, i, *pointer);
+		}
+	}
+
+	return inodes;
+}
+
+uint32_t *FileSystem::frozenPointer(Snapshot *snapshot, uint32_t index, bool allocate)
+{
+	// Table lists the leading inode blocks; longer tables continue through
+	// Extra, a pointer block listing further pointer blocks
+
+	uint32_t ppb = pointersPerBlock();
+
+	if(index < ppb)
+	{
+		return &pointerBlock(snapshot -> Table)[index];
+	}
+
+	index -= ppb;
+	if(index / ppb >= ppb)
+	{
+		return nullptr;
+	}
+
+	if(!snapshot -> Extra && (!allocate || !(snapshot -> Extra = allocateBlock())))
+	{
+		return nullptr;
+	}
+
+	uint32_t *level = &pointerBlock(snapshot -> Extra)[index / ppb];
+	if(!*level && (!allocate || !(*level = allocateBlock())))
+	{
+		return nullptr;
+	}
+
+	return &pointerBlock(*level)[index % ppb];
+}
+
+void FileSystem::freeFrozen(Snapshot *snapshot)
+{
+	// Release the frozen inode blocks and every pointer block listing them
+
+	for(uint32_t i = 0; snapshot -> Table && i < pointersPerBlock(); i++)
+	{
+		freeBlock(pointerBlock(snapshot -> Table)[i]);
+	}
+	freeBlock(snapshot -> Table);
+
+	for(uint32_t i = 0; snapshot -> Extra && i < pointersPerBlock(); i++)
+	{
+		uint32_t level = pointerBlock(snapshot -> Extra)[i];
+
+		for(uint32_t j = 0; level && j < pointersPerBlock(); j++)
+		{
+			freeBlock(pointerBlock(level)[j]);
+		}
+		freeBlock(level);
+	}
+	freeBlock(snapshot -> Extra);
+
+	memset(snapshot, 0, sizeof(Snapshot));
+}
+
+void FileSystem::packInodes(uint32_t index, uint32_t blocknum)
+{
+	// Copy one block's worth of memInodes into an inode block
+
+	char *block = dataBlock(blocknum);
+
+	for(uint32_t j = 0; j < inodesPerBlock(); j++)
+	{
+		memcpy(block + j * inodeSize(), &memInodes[index * inodesPerBlock() + j], inodeSize());
+	}
+}
+
+void FileSystem::unpackInodes(Inode *inodes, uint32_t index, uint32_t blocknum)
+{
+	// Copy one inode block into a table, repairing what a crash damaged
+
+	char *block = dataBlock(blocknum);
+
+	for(uint32_t j = 0; j < inodesPerBlock(); j++)
+	{
+		memcpy(&inodes[index * inodesPerBlock() + j], block + j * inodeSize(), inodeSize());
+		repairInode(&inodes[index * inodesPerBlock() + j]);
+	}
+}
+
+uint32_t FileSystem::readTable(Disk *disk, uint32_t table)
+{
+	// Read a pointer block and the blocks it lists into memBmap; frozen
+	// tables skip blocks without valid inodes, and pointers damaged by a
+	// crash are dropped. Returns the number of blocks listed before the first gap.
+
+	disk -> read(table, dataBlock(table));
+	memRefs[table] = 1;
+
+	uint32_t *pointers = pointerBlock(table);
+	uint32_t blocks = pointersPerBlock();
+
+	for(uint32_t i = 0; i < pointersPerBlock(); i++)
+	{
+		if(pointers[i] && !isBlockValid(pointers[i]))
+		{
+			pointers[i] = 0;
+		}
+
+		if(!pointers[i])
+		{
+			blocks = std::min(blocks, i);
+			continue;
+		}
+
+		disk -> read(pointers[i], dataBlock(pointers[i]));
+		memRefs[pointers[i]] = 1;
+	}
+
+	return blocks;
+}
+
+FileSystem::Inode *FileSystem::loadTable(uint32_t table)
+{
+	// Unpack the inode table listed in a pointer block
+
+	Inode *inodes = new Inode [memSuperBlock -> Super.Inodes]();
+
+	for(uint32_t i = 0; i < inodeBlocks() && pointerBlock(table)[i]; i++)
+	{
+		unpackInodes(inodes, i, pointerBlock(table)[i]);
+	}
+
+	return inodes;
+}
+
+void FileSystem::storeTable(uint32_t table)
+{
+	// Pack memInodes into the inode blocks listed in a pointer block
+
+	for(uint32_t i = 0; i < inodeBlocks(); i++)
+	{
+		packInodes(i, pointerBlock(table)[i]);
+	}
+}
+
+uint32_t *FileSystem::getPointer(Inode *inode, uint32_t index, bool allocate, uint32_t want)
+{
+	// memBmap is the block cache, so every file block lookup goes through here
+
+	SFS_TRACE_SPAN("cache", allocate ? "lookup for write" : "lookup");
+
+	// Locate the slot holding the block number for this file block
+
+	uint32_t *pointer;
+
+	if(index < POINTERS_PER_INODE)
+	{
+		pointer = &inode -> Direct[index];
+	}
+	else if(index < POINTERS_PER_INODE + pointersPerBlock())
+	{
+		if(!inode -> Indirect)
+		{
+			if(!allocate || !(inode -> Indirect = allocateBlock(0, 1, homeBlock(inode - memInodes))))
+			{
+				return nullptr;
+			}
+		}
+		else if(allocate && !unshareIndirect(inode))
+		{
+			return nullptr;
+		}
+		pointer = &pointerBlock(inode -> Indirect)[index - POINTERS_PER_INODE];
+	}
+	else
+	{
+		return nullptr;
+	}
+
+	// Back the slot with a fresh block, or a private copy of a shared one, if asked to
+
+	if(allocate)
+	{
+		// New blocks try to extend the run of the file block before them
+
+		uint32_t *previous = index ? getPointer(inode, index - 1, false) : nullptr;
+		uint32_t hint = previous && *previous ? *previous + 1 : 0;
+		uint32_t home = homeBlock(inode - memInodes);
+
+		uint32_t blocknum = !*pointer ? allocateBlock(hint, want, home) :
+				    memRefs[*pointer] > 1 ? copyBlock(*pointer, hint, home) : *pointer;
+		if(!blocknum)
+		{
+			return nullptr;
+		}
+		*pointer = blocknum;
+	}
+
+	return pointer;
+}
+
+bool FileSystem::unshareIndirect(Inode *inode)
+{
+	if(memRefs[inode -> Indirect] == 1)
+	{
+		return true;
+	}
+
+	// A shared pointer block is copied, and its children gain the copy as an owner
+
+	uint32_t copy = copyBlock(inode -> Indirect, 0, homeBlock(inode - memInodes));
+	if(!copy)
+	{
+		return false;
+	}
+
+	inode -> Indirect = copy;
+	for(uint32_t i = 0; i < pointersPerBlock(); i++)
+	{
+		if(pointerBlock(copy)[i])
+		{
+			memRefs[pointerBlock(copy)[i]]++;
+		}
+	}
+
+	return true;
+}
+
+uint32_t FileSystem::findRun(uint32_t length)
+{
+	// Lowest free run of at least length blocks
+
+	uint32_t run = 0;
+
+	for(uint32_t i = memSuperBlock -> Super.InodeBlocks + 1; i < memSuperBlock -> Super.Blocks; i++)
+	{
+		run = memRefs[i] ? 0 : run + 1;
+
+		if(run == length)
+		{
+			return i + 1 - length;
+		}
+	}
+
+	return BLOCK_UNSET;
+}
+
+bool FileSystem::spillInline(Inode *inode)
+{
+	// Move inline contents into the first data block
+
+	char buffer[INLINE_SIZE];
+	memcpy(buffer, inode -> Inline, INLINE_SIZE);
+	memset(inode -> Inline, 0, INLINE_SIZE);
+
+	// An empty file has nothing to move, so block 0 stays a hole
+
+	if(inode -> Size == 0)
+	{
+		inode -> Valid &= ~INODE_INLINE;
+		return true;
+	}
+
+	uint32_t blocknum = allocateBlock(0, 1, homeBlock(inode - memInodes));
+	if(!blocknum)
+	{
+		memcpy(inode -> Inline, buffer, INLINE_SIZE);
+		return false;
+	}
+
+	inode -> Valid &= ~INODE_INLINE;
+	inode -> Direct[0] = blocknum;
+	memcpy(dataBlock(blocknum), buffer, inode -> Size);
+
+	return true;
 }
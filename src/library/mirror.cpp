@@ -0,0 +1,475 @@
+// mirror.cpp: Mirrored disk volume
+
+#include "sfs/mirror.h"
+#include "sfs/trace.h"
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+#include <stdio.h>
+
+void MirroredDisk::open(const std::vector<std::string> &paths, size_t nblocks) {
+    if (paths.empty()) {
+    	throw std::invalid_argument("mirrored disk needs at least one replica");
+    }
+
+    // Each replica keeps a checksum table after its data blocks and a header
+    // with its generation in the last block
+
+    TableBlocks = (nblocks + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK;
+
+    for (size_t i = 0; i < paths.size(); i++) {
+    	Disk *member = new Disk;
+    	try {
+    	    member->open(paths[i].c_str(), nblocks + TableBlocks + 1);
+    	} catch (...) {
+    	    delete member;
+    	    throw;
+    	}
+    	Members.push_back(member);
+    	Locks.push_back(new std::mutex);
+
+    	Sums.push_back(std::vector<uint32_t>(TableBlocks*SUMS_PER_BLOCK, 0));
+    	member->read(nblocks, TableBlocks, Sums.back().data());
+
+    	char block[BLOCK_SIZE];
+    	Header *header = (Header *)block;
+    	member->read(nblocks + TableBlocks, block);
+    	Generations.push_back(header->MagicNumber == MAGIC_NUMBER ? header->Generation : 0);
+    }
+
+    Pending = new std::atomic<unsigned>[Members.size()]();
+    Stale.assign(Members.size(), std::vector<bool>(nblocks, false));
+    Checksums.assign(nblocks, 0);
+    Split.assign(nblocks, false);
+    Generation = *std::max_element(Generations.begin(), Generations.end());
+
+    // Replicas from an older generation missed writes and are stale
+    // throughout. Among the rest a block's checksum is the one a strict
+    // majority of the replicas that know it agree on; a zero (unknown)
+    // checksum never votes, and without a majority the block is split
+
+    for (size_t b = 0; b < nblocks; b++) {
+    	std::map<uint32_t, size_t> votes;
+    	size_t known = 0;
+    	for (size_t m = 0; m < Members.size(); m++) {
+    	    if (Generations[m] == Generation && Sums[m][b]) {
+    	    	votes[Sums[m][b]]++;
+    	    	known++;
+    	    }
+    	}
+
+    	uint32_t current = 0;
+    	for (std::map<uint32_t, size_t>::iterator it = votes.begin(); it != votes.end(); it++) {
+    	    if (2*it->second > known) {
+    	    	current = it->first;
+    	    }
+    	}
+
+    	Checksums[b] = current;
+    	Split[b] = known && !current;
+    	for (size_t m = 0; m < Members.size(); m++) {
+    	    Stale[m][b] = Generations[m] != Generation || (current && Sums[m][b] != current);
+    	}
+    }
+
+    // Each session starts a new generation, so a replica left out of it is
+    // known to be behind when it comes back
+
+    for (size_t m = 0; m < Members.size(); m++) {
+    	if (Generations[m] == Generation) {
+    	    stamp(m, Generation + 1);
+    	    Generations[m] = Generation + 1;
+    	}
+    }
+    Generation++;
+
+    Bytes  = nblocks*BLOCK_SIZE;
+    Blocks = nblocks;
+    Reads  = 0;
+    Writes = 0;
+}
+
+MirroredDisk::~MirroredDisk() {
+    if (!Members.empty()) {
+    	printf("%lu mirrored block reads\n", Reads);
+    	printf("%lu mirrored block writes\n", Writes);
+    }
+
+    for (size_t i = 0; i < Members.size(); i++) {
+    	delete Members[i];
+    	delete Locks[i];
+    }
+    delete [] Pending;
+}
+
+uint32_t MirroredDisk::checksum(const void *data) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+    	hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash ? hash : 1;
+}
+
+int MirroredDisk::choose(int blocknum) {
+    std::lock_guard<std::mutex> guard(State);
+
+    // Ties go round-robin so idle replicas share the load
+
+    int best = -1;
+    for (size_t i = 0; i < Members.size(); i++) {
+    	size_t m = (Next + i) % Members.size();
+    	if (Stale[m][blocknum]) {
+    	    continue;
+    	}
+    	if (best < 0 || Pending[m] < Pending[best]) {
+    	    best = m;
+    	}
+    }
+
+    Next++;
+    return best;
+}
+
+void MirroredDisk::readBlock(int blocknum, void *data, size_t first) {
+    for (size_t i = 0; i < Members.size(); i++) {
+    	size_t m = (first + i) % Members.size();
+
+    	uint32_t expected;
+    	{
+    	    std::lock_guard<std::mutex> guard(State);
+    	    if (Stale[m][blocknum]) {
+    	    	continue;
+    	    }
+    	    expected = Checksums[blocknum];
+    	}
+
+    	// A replica that errors or returns the wrong contents is marked for resync
+
+    	bool good = true;
+    	Pending[m]++;
+    	try {
+    	    std::lock_guard<std::mutex> guard(*Locks[m]);
+    	    Members[m]->read(blocknum, data);
+    	    good = !expected || checksum(data) == expected;
+    	} catch (std::exception &e) {
+    	    good = false;
+    	}
+    	Pending[m]--;
+
+    	if (good) {
+    	    return;
+    	}
+
+    	std::lock_guard<std::mutex> guard(State);
+    	Stale[m][blocknum] = true;
+    }
+
+    char what[BUFSIZ];
+    snprintf(what, BUFSIZ, "No replica holds a good copy of block %d", blocknum);
+    throw std::runtime_error(what);
+}
+
+void MirroredDisk::read(int blocknum, void *data) {
+    SFS_TRACE_SPAN("mirror", "read");
+
+    sanity_check(blocknum, data);
+
+    int m = choose(blocknum);
+    readBlock(blocknum, data, m < 0 ? 0 : m);
+
+    Reads++;
+}
+
+void MirroredDisk::read(int blocknum, size_t nblocks, void *data) {
+    SFS_TRACE_SPAN("mirror", "read run");
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    sanity_check(blocknum, data);
+    sanity_check(blocknum + nblocks - 1, data);
+
+    // Each replica serves one slice of the run; bad blocks fall back one at a time
+
+    size_t slice = (nblocks + Members.size() - 1) / Members.size();
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(Members.size());
+
+    for (size_t m = 0; m < Members.size() && m*slice < nblocks; m++) {
+    	workers.push_back(std::thread([=, &errors]() {
+    	    size_t start = m*slice;
+    	    size_t count = std::min(slice, nblocks - start);
+    	    char  *buffer = (char *)data + start*BLOCK_SIZE;
+
+    	    bool failed = false;
+    	    Pending[m] += count;
+    	    try {
+    	    	std::lock_guard<std::mutex> guard(*Locks[m]);
+    	    	Members[m]->read(blocknum + start, count, buffer);
+    	    } catch (std::exception &e) {
+    	    	failed = true;
+    	    }
+    	    Pending[m] -= count;
+
+    	    try {
+    	    	for (size_t i = 0; i < count; i++) {
+    	    	    int b = blocknum + start + i;
+    	    	    bool good = !failed;
+
+    	    	    if (good) {
+    	    	    	std::lock_guard<std::mutex> guard(State);
+    	    	    	good = !Stale[m][b] && (!Checksums[b] || checksum(buffer + i*BLOCK_SIZE) == Checksums[b]);
+    	    	    	Stale[m][b] = !good;
+    	    	    }
+
+    	    	    if (!good) {
+    	    	    	readBlock(b, buffer + i*BLOCK_SIZE, (m + 1) % Members.size());
+    	    	    }
+    	    	}
+    	    } catch (...) {
+    	    	errors[m] = std::current_exception();
+    	    }
+    	}));
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+    	workers[i].join();
+    }
+
+    for (size_t i = 0; i < errors.size(); i++) {
+    	if (errors[i]) {
+    	    std::rethrow_exception(errors[i]);
+    	}
+    }
+
+    Reads += nblocks;
+}
+
+void MirroredDisk::store(size_t member, int blocknum, size_t nblocks, const char *data) {
+    Members[member]->write(blocknum, nblocks, (void *)data);
+
+    // Persist the replica's checksums for the run after its data
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	Sums[member][blocknum + i] = checksum(data + i*BLOCK_SIZE);
+    }
+
+    size_t first = blocknum / SUMS_PER_BLOCK;
+    size_t last  = (blocknum + nblocks - 1) / SUMS_PER_BLOCK;
+    Members[member]->write(Blocks + first, last - first + 1, &Sums[member][first*SUMS_PER_BLOCK]);
+}
+
+void MirroredDisk::stamp(size_t member, uint32_t generation) {
+    char block[BLOCK_SIZE] = {0};
+    Header *header = (Header *)block;
+    header->MagicNumber = MAGIC_NUMBER;
+    header->Generation  = generation;
+    Members[member]->write(Members[member]->size() - 1, block);
+}
+
+void MirroredDisk::fanout(int blocknum, size_t nblocks, char *data) {
+    SFS_TRACE_SPAN("mirror", "write");
+
+    {
+    	std::lock_guard<std::mutex> guard(State);
+    	for (size_t i = 0; i < nblocks; i++) {
+    	    Checksums[blocknum + i] = checksum(data + i*BLOCK_SIZE);
+    	    Split[blocknum + i] = false;
+    	}
+    }
+
+    // Every replica gets the write at once; a failed replica only goes stale
+
+    std::vector<std::thread> workers;
+    std::vector<char> failed(Members.size(), false);
+    std::atomic<unsigned> failures(0);
+
+    for (size_t m = 0; m < Members.size(); m++) {
+    	workers.push_back(std::thread([=, &failed, &failures]() {
+    	    Pending[m] += nblocks;
+    	    try {
+    	    	std::lock_guard<std::mutex> guard(*Locks[m]);
+    	    	store(m, blocknum, nblocks, data);
+    	    } catch (std::exception &e) {
+    	    	failed[m] = true;
+    	    	failures++;
+    	    }
+    	    Pending[m] -= nblocks;
+
+    	    std::lock_guard<std::mutex> guard(State);
+    	    for (size_t i = 0; i < nblocks; i++) {
+    	    	Stale[m][blocknum + i] = failed[m];
+    	    }
+    	}));
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+    	workers[i].join();
+    }
+
+    // A replica that just fell behind must lose to the others on reopen, so
+    // they move on to a new generation
+
+    std::vector<size_t> survivors;
+    uint32_t generation;
+    {
+    	std::lock_guard<std::mutex> guard(State);
+    	bool behind = false;
+    	for (size_t m = 0; m < Members.size(); m++) {
+    	    behind = behind || (failed[m] && Generations[m] == Generation);
+    	}
+    	for (size_t m = 0; behind && m < Members.size(); m++) {
+    	    if (!failed[m] && Generations[m] == Generation) {
+    	    	survivors.push_back(m);
+    	    	Generations[m] = Generation + 1;
+    	    }
+    	}
+    	if (behind) {
+    	    Generation++;
+    	}
+    	generation = Generation;
+    }
+
+    for (size_t i = 0; i < survivors.size(); i++) {
+    	try {
+    	    std::lock_guard<std::mutex> guard(*Locks[survivors[i]]);
+    	    stamp(survivors[i], generation);
+    	} catch (std::exception &e) {
+    	    continue;
+    	}
+    }
+
+    if (failures == Members.size()) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to write %d+%lu to any replica", blocknum, nblocks);
+    	throw std::runtime_error(what);
+    }
+}
+
+void MirroredDisk::write(int blocknum, void *data) {
+    sanity_check(blocknum, data);
+
+    fanout(blocknum, 1, (char *)data);
+
+    Writes++;
+}
+
+void MirroredDisk::write(int blocknum, size_t nblocks, void *data) {
+    if (nblocks == 0) {
+    	return;
+    }
+
+    sanity_check(blocknum, data);
+    sanity_check(blocknum + nblocks - 1, data);
+
+    fanout(blocknum, nblocks, (char *)data);
+
+    Writes += nblocks;
+}
+
+size_t MirroredDisk::resync(bool full) {
+    SFS_TRACE_SPAN("mirror", "resync");
+
+    char good[BLOCK_SIZE];
+    char copy[BLOCK_SIZE];
+    size_t copies = 0;
+
+    for (size_t b = 0; b < Blocks; b++) {
+    	std::vector<bool> diverged(Members.size(), false);
+    	bool any = false;
+
+    	{
+    	    // No replica can be trusted over another for a split block
+
+    	    std::lock_guard<std::mutex> guard(State);
+    	    if (Split[b]) {
+    	    	continue;
+    	    }
+    	    for (size_t m = 0; m < Members.size(); m++) {
+    	    	diverged[m] = Stale[m][b];
+    	    	any = any || diverged[m];
+    	    }
+    	}
+
+    	// A scrub reads every replica back against the current checksum
+
+    	for (size_t m = 0; full && m < Members.size(); m++) {
+    	    if (diverged[m]) {
+    	    	continue;
+    	    }
+    	    try {
+    	    	std::lock_guard<std::mutex> guard(*Locks[m]);
+    	    	Members[m]->read(b, copy);
+    	    	diverged[m] = Checksums[b] && checksum(copy) != Checksums[b];
+    	    } catch (std::exception &e) {
+    	    	diverged[m] = true;
+    	    }
+    	    any = any || diverged[m];
+
+    	    std::lock_guard<std::mutex> guard(State);
+    	    Stale[m][b] = diverged[m];
+    	}
+
+    	if (!any) {
+    	    continue;
+    	}
+
+    	try {
+    	    readBlock(b, good, 0);
+    	} catch (std::exception &e) {
+    	    continue;
+    	}
+
+    	for (size_t m = 0; m < Members.size(); m++) {
+    	    if (!diverged[m]) {
+    	    	continue;
+    	    }
+    	    try {
+    	    	std::lock_guard<std::mutex> guard(*Locks[m]);
+    	    	store(m, b, 1, good);
+    	    } catch (std::exception &e) {
+    	    	continue;
+    	    }
+
+    	    std::lock_guard<std::mutex> guard(State);
+    	    Stale[m][b] = false;
+    	    copies++;
+    	}
+    }
+
+    // A replica holding every block again has caught up with the others
+
+    for (size_t m = 0; m < Members.size(); m++) {
+    	uint32_t generation;
+    	{
+    	    std::lock_guard<std::mutex> guard(State);
+    	    if (Generations[m] == Generation || std::find(Stale[m].begin(), Stale[m].end(), true) != Stale[m].end()) {
+    	    	continue;
+    	    }
+    	    generation = Generation;
+    	    Generations[m] = Generation;
+    	}
+
+    	try {
+    	    std::lock_guard<std::mutex> guard(*Locks[m]);
+    	    stamp(m, generation);
+    	} catch (std::exception &e) {
+    	    continue;
+    	}
+    }
+
+    return copies;
+}
+
+size_t MirroredDisk::conflicts() {
+    std::lock_guard<std::mutex> guard(State);
+    return std::count(Split.begin(), Split.end(), true);
+}
@@ -0,0 +1,221 @@
+// stripe.cpp: Striped disk volume
+
+#include "sfs/stripe.h"
+#include "sfs/trace.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void StripedDisk::open(const std::vector<std::string> &paths, size_t nblocks, size_t stripe) {
+    if (paths.empty() || stripe == 0) {
+    	throw std::invalid_argument("striped disk needs at least one member and a non-zero stripe");
+    }
+
+    // Block 0 always lands on the first member, so a volume opened with
+    // another stripe size or member order would mount and then scramble its
+    // data; members check the geometry they were striped with first
+
+    size_t headers = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+    	Geometry geometry;
+    	if (!readGeometry(paths[i].c_str(), geometry)) {
+    	    continue;
+    	}
+
+    	if (geometry.StripeBlocks != stripe || geometry.Members != paths.size() || geometry.Index != i) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "%s is member %u of %u striped with %u-block units, not member %lu of %lu with %lu-block units",
+    	    	paths[i].c_str(), geometry.Index, geometry.Members, geometry.StripeBlocks, i, paths.size(), stripe);
+    	    throw std::runtime_error(what);
+    	}
+    	headers++;
+    }
+
+    if (headers && headers != paths.size()) {
+    	throw std::runtime_error("only some members carry a stripe geometry header");
+    }
+
+    // Every member holds the same number of whole stripe units, followed by its header
+
+    size_t units = (nblocks + stripe - 1) / stripe;
+    size_t memberBlocks = (units + paths.size() - 1) / paths.size() * stripe;
+
+    for (size_t i = 0; i < paths.size(); i++) {
+    	Disk *member = new Disk;
+    	try {
+    	    member->open(paths[i].c_str(), memberBlocks + 1);
+    	} catch (...) {
+    	    delete member;
+    	    throw;
+    	}
+    	Members.push_back(member);
+
+    	char header[BLOCK_SIZE] = {0};
+    	Geometry *geometry = (Geometry *)header;
+    	geometry->MagicNumber  = MAGIC_NUMBER;
+    	geometry->StripeBlocks = stripe;
+    	geometry->Members      = paths.size();
+    	geometry->Index        = i;
+    	member->write(memberBlocks, header);
+    }
+
+    StripeBlocks = stripe;
+    Bytes  = nblocks*BLOCK_SIZE;
+    Blocks = nblocks;
+    Reads  = 0;
+    Writes = 0;
+}
+
+StripedDisk::~StripedDisk() {
+    if (!Members.empty()) {
+    	printf("%lu striped block reads\n", Reads);
+    	printf("%lu striped block writes\n", Writes);
+    }
+
+    for (size_t i = 0; i < Members.size(); i++) {
+    	delete Members[i];
+    }
+}
+
+bool StripedDisk::readGeometry(const char *path, Geometry &geometry) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+    	return false;
+    }
+
+    // The header is the last block of the image as it was last opened
+
+    struct stat st;
+    bool found = fstat(fd, &st) == 0 && st.st_size >= (off_t)BLOCK_SIZE && st.st_size % BLOCK_SIZE == 0 &&
+    	pread(fd, &geometry, sizeof(geometry), st.st_size - BLOCK_SIZE) == sizeof(geometry) &&
+    	geometry.MagicNumber == MAGIC_NUMBER;
+
+    close(fd);
+    return found;
+}
+
+bool StripedDisk::setBlockSize(size_t size) {
+    if (!Disk::setBlockSize(size)) {
+    	return false;
+    }
+
+    // Stripe units stay StripeBlocks blocks long, so they grow with the blocks
+
+    for (size_t i = 0; i < Members.size(); i++) {
+    	Members[i]->setBlockSize(size);
+    }
+
+    // Rounding can leave members short of the last units, so drop those; a
+    // unit never reaches into the geometry header at the end of a member
+
+    size_t units = (Members[0]->bytes() - BLOCK_SIZE) / size / StripeBlocks;
+    Blocks = std::min(Blocks, Members.size() * units * StripeBlocks);
+    return true;
+}
+
+int StripedDisk::locate(int blocknum, size_t &member) {
+    size_t unit = blocknum / StripeBlocks;
+
+    member = unit % Members.size();
+    return (unit / Members.size()) * StripeBlocks + blocknum % StripeBlocks;
+}
+
+void StripedDisk::read(int blocknum, void *data) {
+    sanity_check(blocknum, data);
+
+    size_t member;
+    int memberBlock = locate(blocknum, member);
+    Members[member]->read(memberBlock, data);
+
+    Reads++;
+}
+
+void StripedDisk::write(int blocknum, void *data) {
+    sanity_check(blocknum, data);
+
+    size_t member;
+    int memberBlock = locate(blocknum, member);
+    Members[member]->write(memberBlock, data);
+
+    Writes++;
+}
+
+void StripedDisk::read(int blocknum, size_t nblocks, void *data) {
+    transfer(blocknum, nblocks, (char *)data, false);
+    Reads += nblocks;
+}
+
+void StripedDisk::write(int blocknum, size_t nblocks, void *data) {
+    transfer(blocknum, nblocks, (char *)data, true);
+    Writes += nblocks;
+}
+
+void StripedDisk::transfer(int blocknum, size_t nblocks, char *data, bool writing) {
+    SFS_TRACE_SPAN("stripe", writing ? "write run" : "read run");
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    sanity_check(blocknum, data);
+    sanity_check(blocknum + nblocks - 1, data);
+
+    // Runs inside one stripe unit need no workers
+
+    if (blocknum / StripeBlocks == (blocknum + nblocks - 1) / StripeBlocks) {
+    	size_t only;
+    	int memberBlock = locate(blocknum, only);
+    	if (writing) {
+    	    Members[only]->write(memberBlock, nblocks, data);
+    	} else {
+    	    Members[only]->read(memberBlock, nblocks, data);
+    	}
+    	return;
+    }
+
+    // One worker per member walks that member's stripe units in order
+
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(Members.size());
+
+    for (size_t m = 0; m < Members.size(); m++) {
+    	workers.push_back(std::thread([=, &errors]() {
+    	    try {
+    	    	for (size_t i = 0; i < nblocks; ) {
+    	    	    size_t member;
+    	    	    int memberBlock = locate(blocknum + i, member);
+    	    	    size_t run = std::min(nblocks - i, StripeBlocks - (blocknum + i) % StripeBlocks);
+
+    	    	    if (member == m) {
+    	    	    	if (writing) {
+    	    	    	    Members[m]->write(memberBlock, run, data + i*BlockSize);
+    	    	    	} else {
+    	    	    	    Members[m]->read(memberBlock, run, data + i*BlockSize);
+    	    	    	}
+    	    	    }
+    	    	    i += run;
+    	    	}
+    	    } catch (...) {
+    	    	errors[m] = std::current_exception();
+    	    }
+    	}));
+    }
+
+    for (size_t m = 0; m < workers.size(); m++) {
+    	workers[m].join();
+    }
+
+    for (size_t m = 0; m < errors.size(); m++) {
+    	if (errors[m]) {
+    	    std::rethrow_exception(errors[m]);
+    	}
+    }
+}
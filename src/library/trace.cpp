@@ -0,0 +1,160 @@
+// trace.cpp: Operation tracing
+
+#include "sfs/trace.h"
+
+#ifdef SFS_TRACE
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+#include <unistd.h>
+
+struct TraceEvent {
+    const char *Category;
+    const char *Name;
+    uint64_t	Start;
+    uint64_t	Duration;
+};
+
+struct TraceRing {
+    std::mutex	Lock;	    // Held while recording, so dump and clear see whole events
+    std::vector<TraceEvent> Events;
+    size_t	Next;	    // Number of spans ever recorded
+    uint32_t	Thread;	    // Thread id shown in the trace
+};
+
+// Rings outlive their threads so short-lived workers still show up in a dump;
+// a thread hands its ring back when it exits and the next new thread reuses
+// it, so stripe and mirror workers do not add a ring per transfer
+
+static std::mutex RingsLock;
+static std::vector<TraceRing *> Rings;
+static std::vector<TraceRing *> FreeRings;
+
+struct RingOwner {
+    TraceRing *Ring;
+
+    RingOwner() : Ring(nullptr) {}
+
+    ~RingOwner() {
+    	if (Ring) {
+    	    std::lock_guard<std::mutex> guard(RingsLock);
+    	    FreeRings.push_back(Ring);
+    	}
+    }
+};
+
+static thread_local RingOwner LocalRing;
+
+std::atomic<bool> Trace::Active(false);
+
+static TraceRing *ring() {
+    if (LocalRing.Ring == nullptr) {
+    	std::lock_guard<std::mutex> guard(RingsLock);
+
+    	if (!FreeRings.empty()) {
+    	    LocalRing.Ring = FreeRings.back();
+    	    FreeRings.pop_back();
+    	} else {
+    	    TraceRing *local = new TraceRing;
+    	    local->Events.resize(Trace::RING_EVENTS);
+    	    local->Next = 0;
+    	    local->Thread = Rings.size() + 1;
+    	    Rings.push_back(local);
+    	    LocalRing.Ring = local;
+    	}
+    }
+
+    return LocalRing.Ring;
+}
+
+uint64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char *category, const char *name, uint64_t start, uint64_t end) {
+    TraceRing *local = ring();
+    std::lock_guard<std::mutex> guard(local->Lock);
+    TraceEvent &event = local->Events[local->Next++ % RING_EVENTS];
+
+    event.Category = category;
+    event.Name = name;
+    event.Start = start;
+    event.Duration = end - start;
+}
+
+bool Trace::available() {
+    return true;
+}
+
+void Trace::enable(bool on) {
+    Active = on;
+}
+
+bool Trace::enabled() {
+    return Active;
+}
+
+void Trace::clear() {
+    std::lock_guard<std::mutex> guard(RingsLock);
+    for (size_t i = 0; i < Rings.size(); i++) {
+    	std::lock_guard<std::mutex> ring(Rings[i]->Lock);
+    	Rings[i]->Next = 0;
+    }
+}
+
+bool Trace::dump(const char *path) {
+    FILE *stream = fopen(path, "w");
+    if (stream == nullptr) {
+    	return false;
+    }
+
+    // Spans that finish while their ring is written out wait for it
+
+    std::lock_guard<std::mutex> guard(RingsLock);
+
+    fprintf(stream, "{\"traceEvents\":[\n");
+
+    bool first = true;
+    for (size_t r = 0; r < Rings.size(); r++) {
+    	TraceRing *ring = Rings[r];
+    	std::lock_guard<std::mutex> hold(ring->Lock);
+    	size_t oldest = ring->Next > RING_EVENTS ? ring->Next - RING_EVENTS : 0;
+
+    	for (size_t i = oldest; i < ring->Next; i++) {
+    	    TraceEvent &event = ring->Events[i % RING_EVENTS];
+    	    fprintf(stream, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+    	    	    first ? "" : ",\n", event.Name, event.Category, event.Start / 1000.0, event.Duration / 1000.0, getpid(), ring->Thread);
+    	    first = false;
+    	}
+    }
+
+    fprintf(stream, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(stream);
+
+    return true;
+}
+
+#else
+
+bool Trace::available() {
+    return false;
+}
+
+void Trace::enable(bool on) {
+}
+
+bool Trace::enabled() {
+    return false;
+}
+
+void Trace::clear() {
+}
+
+bool Trace::dump(const char *path) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,346 @@
+// sfsd.cpp: Simple file system block server
+
+#include "sfs/client.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// One thread owns the file system; clients pipeline requests over Unix-domain
+// sockets and every request that has fully arrived is answered in one write.
+// With -d, files are defragmented in the background whenever no client has
+// anything pending.
+
+const static int DEFRAG_PAUSE = 60;		// Seconds between background defrag passes
+
+typedef Client::Request  Request;
+typedef Client::Response Response;
+typedef std::chrono::steady_clock Clock;
+
+struct Connection {
+	int fd;
+	std::vector<char> input;	// Bytes received but not yet handled
+	std::vector<char> output;	// Responses not yet sent
+	size_t sent;			// Bytes of output already sent
+};
+
+struct Defrag {
+	size_t rate;			// Blocks moved per second at most (0 when off)
+	ssize_t next;			// Inode the pass continues from (-1 between passes)
+	size_t moved;			// Blocks moved so far in this pass
+	Clock::time_point start;	// When this pass or the pause after it began
+};
+
+// Global state
+
+Disk		Image;
+FileSystem	Fs;
+volatile sig_atomic_t Running = 1;
+
+// Helper functions
+
+void handle_signal(int signum) {
+	Running = 0;
+}
+
+int listen_socket(const char *path) {
+	struct sockaddr_un address;
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+// Run one request; data points at its write payload and any read payload is
+// appended to the connection's output after the response header
+void do_request(Connection &connection, const Request &request, char *data) {
+	Response response;
+	memset(&response, 0, sizeof(response));
+	response.Op = request.Op;
+
+	size_t header = connection.output.size();
+	connection.output.resize(header + sizeof(Response));
+
+	switch (request.Op) {
+		case Client::OP_CREATE:
+			response.Result = Fs.create();
+			break;
+		case Client::OP_REMOVE:
+			response.Result = Fs.remove(request.Inumber);
+			break;
+		case Client::OP_STAT:
+			response.Result = Fs.stat(request.Inumber);
+			break;
+		case Client::OP_READ:
+			connection.output.resize(header + sizeof(Response) + request.Length);
+			response.Result = Fs.read(request.Inumber, connection.output.data() + header + sizeof(Response), request.Length, request.Offset);
+			response.Length = response.Result > 0 ? response.Result : 0;
+			connection.output.resize(header + sizeof(Response) + response.Length);
+			break;
+		case Client::OP_WRITE:
+			response.Result = Fs.write(request.Inumber, data, request.Length, request.Offset);
+			break;
+		default:
+			response.Result = -1;
+			break;
+	}
+
+	memcpy(connection.output.data() + header, &response, sizeof(response));
+}
+
+// Handle every complete request in the input buffer
+// Returns false if the client sent something malformed.
+bool do_requests(Connection &connection) {
+	size_t consumed = 0;
+
+	while (connection.input.size() - consumed >= sizeof(Request)) {
+		Request request;
+		memcpy(&request, connection.input.data() + consumed, sizeof(request));
+
+		if (request.Length > Client::MAX_PAYLOAD) {
+			return false;
+		}
+
+		size_t payload = request.Op == Client::OP_WRITE ? request.Length : 0;
+		if (connection.input.size() - consumed < sizeof(Request) + payload) {
+			break;
+		}
+
+		do_request(connection, request, connection.input.data() + consumed + sizeof(Request));
+		consumed += sizeof(Request) + payload;
+	}
+
+	connection.input.erase(connection.input.begin(), connection.input.begin() + consumed);
+	return true;
+}
+
+// Returns false once the connection should be closed
+bool do_receive(Connection &connection) {
+	char buffer[64 * 1024];
+
+	while (true) {
+		ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		connection.input.insert(connection.input.end(), buffer, buffer + received);
+	}
+
+	return do_requests(connection);
+}
+
+// Returns the milliseconds until the next defrag step may run (-1 when off)
+int defrag_wait(const Defrag &defrag) {
+	if (!defrag.rate) {
+		return -1;
+	}
+
+	Clock::time_point due = defrag.next < 0 ? defrag.start + std::chrono::seconds(DEFRAG_PAUSE) :
+		defrag.start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((double)defrag.moved / defrag.rate));
+
+	Clock::time_point now = Clock::now();
+	return due <= now ? 0 : std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+}
+
+// Relocate the next file of the pass, keeping the pass under its rate
+void do_defrag(Defrag &defrag) {
+	if (defrag_wait(defrag) != 0) {
+		return;
+	}
+
+	if (defrag.next < 0) {
+		defrag.next = 0;
+		defrag.moved = 0;
+		defrag.start = Clock::now();
+	}
+
+	size_t moved;
+	ssize_t inumber = Fs.defrag(defrag.next, moved);
+	defrag.moved += moved;
+	defrag.next = inumber < 0 ? -1 : inumber + 1;
+
+	if (inumber < 0) {
+		defrag.start = Clock::now();
+	}
+}
+
+bool do_send(Connection &connection) {
+	while (connection.sent < connection.output.size()) {
+		ssize_t sent = send(connection.fd, connection.output.data() + connection.sent, connection.output.size() - connection.sent, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (sent <= 0) {
+			return false;
+		}
+		connection.sent += sent;
+	}
+
+	connection.output.clear();
+	connection.sent = 0;
+	return true;
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+	Defrag defrag;
+	defrag.rate = 0;
+	defrag.next = 0;
+	defrag.moved = 0;
+	defrag.start = Clock::now();
+
+	int option;
+	while ((option = getopt(argc, argv, "d:")) != -1) {
+		switch (option) {
+			case 'd':
+				defrag.rate = strtoul(optarg, nullptr, 10);
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+
+	if (argc - optind != 3) {
+		fprintf(stderr, "Usage: %s [-d blocks/s] <diskfile> <nblocks> <socket>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char *path = argv[optind];
+	const char *socket = argv[optind + 2];
+
+	try {
+		Image.open(path, atoi(argv[optind + 1]));
+	} catch (std::runtime_error &e) {
+		fprintf(stderr, "Unable to open disk %s: %s\n", path, e.what());
+		return EXIT_FAILURE;
+	}
+
+	if (!Fs.mount(&Image)) {
+		fprintf(stderr, "Unable to mount %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	int listener = listen_socket(socket);
+	if (listener < 0) {
+		Fs.umount(&Image);
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	std::vector<Connection> connections;
+
+	while (Running) {
+		std::vector<struct pollfd> fds(connections.size() + 1);
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < connections.size(); i++) {
+			fds[i + 1].fd = connections[i].fd;
+			fds[i + 1].events = connections[i].output.empty() ? POLLIN : POLLIN | POLLOUT;
+		}
+
+		// Defrag only gets the turns in which no client is ready
+
+		int ready = poll(fds.data(), fds.size(), defrag_wait(defrag));
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+
+		if (ready == 0) {
+			do_defrag(defrag);
+			continue;
+		}
+
+		// Walk backwards so closed connections can be erased in place
+
+		for (size_t i = connections.size(); i > 0; i--) {
+			Connection &connection = connections[i - 1];
+			short revents = fds[i].revents;
+			bool open = true;
+
+			if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				open = do_receive(connection);
+			}
+			if (open && !connection.output.empty()) {
+				open = do_send(connection);
+			}
+			if (!open) {
+				close(connection.fd);
+				connections.erase(connections.begin() + (i - 1));
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd;
+			while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				Connection connection;
+				connection.fd = fd;
+				connection.sent = 0;
+				connections.push_back(connection);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < connections.size(); i++) {
+		close(connections[i].fd);
+	}
+	close(listener);
+	unlink(socket);
+
+	Fs.umount(&Image);
+	return EXIT_SUCCESS;
+}
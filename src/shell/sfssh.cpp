@@ -2,19 +2,48 @@
 
 #include "sfs/disk.h"
 #include "sfs/fs.h"
-
+#include "sfs/mirror.h"
+#include "sfs/stripe.h"
+#include "sfs/trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Macros
 
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+// Global state
+
+size_t Failures = 0;	// Commands that failed; a batch run exits non-zero if any did
+
+// Directory transfers
+
+const static size_t TRANSFER_SIZE    = 1 << 20;	// Bytes moved per host read or write
+const static size_t TRANSFER_ALIGN   = 4096;	// Buffer alignment for host I/O
+const static size_t TRANSFER_THREADS = 8;	// Default (and maximum) worker threads
+
+struct Transfer {
+	std::string path;	// Host file
+	size_t inumber;		// Inode it is copied to or from
+	ssize_t bytes;		// Bytes copied, or -1 on error
+};
+
 // Command prototypes
 
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
@@ -27,34 +56,91 @@ void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_snapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_snapshots(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_rmsnapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_resync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_policy(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_import_dir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_export_dir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
 bool copyin(FileSystem &fs, const char *path, size_t inumber);
+void list_files(const std::string &dir, std::vector<Transfer> &files);
+void run_transfers(FileSystem &fs, std::vector<Transfer> &transfers, size_t threads, bool import, const char *verb);
+ssize_t import_file(FileSystem &fs, std::mutex &lock, Transfer &transfer, char *buffer);
+ssize_t import_data(FileSystem &fs, std::mutex &lock, int fd, const char *path, size_t inumber, char *buffer, size_t size);
+ssize_t export_file(FileSystem &fs, std::mutex &lock, Transfer &transfer, char *buffer);
 
 // Main execution
 
 int main(int argc, char *argv[]) {
-	Disk	disk;
+	Disk	*disk;
 	FileSystem	fs;
+	size_t	stripe = StripedDisk::DEFAULT_STRIPE;
+	bool	mirror = false;
+	bool	batch = false;
+
+	int option;
+	while ((option = getopt(argc, argv, "bms:")) != -1) {
+		switch (option) {
+			case 'b':
+				batch = true;
+				break;
+			case 'm':
+				mirror = true;
+				break;
+			case 's':
+				stripe = atoi(optarg);
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+	if (argc - optind != 2) {
+		fprintf(stderr, "Usage: %s [-b] [-m | -s stripe] <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	// Several comma-separated images are mirrored or striped into one volume
+
+	std::vector<std::string> paths;
+	std::stringstream images(argv[optind]);
+	for (std::string path; std::getline(images, path, ','); ) {
+		paths.push_back(path);
+	}
+
 	try {
-		disk.open(argv[1], atoi(argv[2]));
-	} catch (std::runtime_error &e) {
-		fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+		if (paths.size() > 1 && mirror) {
+			MirroredDisk *mirrored = new MirroredDisk;
+			disk = mirrored;
+			mirrored->open(paths, atoi(argv[optind + 1]));
+		} else if (paths.size() > 1) {
+			StripedDisk *striped = new StripedDisk;
+			disk = striped;
+			striped->open(paths, atoi(argv[optind + 1]), stripe);
+		} else {
+			disk = new Disk;
+			disk->open(argv[optind], atoi(argv[optind + 1]));
+		}
+	} catch (std::exception &e) {
+		fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind], e.what());
 		return EXIT_FAILURE;
 	}
 
 	while (true) {
 		char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
 
-		fprintf(stderr, "sfs> ");
-		fflush(stderr);
+		if (!batch) {
+			fprintf(stderr, "sfs> ");
+			fflush(stderr);
+		}
 
 		if (fgets(line, BUFSIZ, stdin) == NULL) {
 			break;
@@ -66,36 +152,65 @@ int main(int argc, char *argv[]) {
 		}
 
 		if (streq(cmd, "debug")) {
-			do_debug(disk, fs, args, arg1, arg2);
+			do_debug(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "format")) {
-			do_format(disk, fs, args, arg1, arg2);
+			do_format(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "mount")) {
-			do_mount(disk, fs, args, arg1, arg2);
+			do_mount(*disk, fs, args, arg1, arg2);
 		} else if(streq(cmd, "umount")) {
-			do_umount(disk, fs, args, arg1, arg2);
+			do_umount(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "cat")) {
-			do_cat(disk, fs, args, arg1, arg2);
+			do_cat(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "copyout")) {
-			do_copyout(disk, fs, args, arg1, arg2);
+			do_copyout(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "create")) {
-			do_create(disk, fs, args, arg1, arg2);
+			do_create(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "remove")) {
-			do_remove(disk, fs, args, arg1, arg2);
+			do_remove(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "stat")) {
-			do_stat(disk, fs, args, arg1, arg2);
+			do_stat(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "copyin")) {
-			do_copyin(disk, fs, args, arg1, arg2);
+			do_copyin(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "clone")) {
+			do_clone(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "snapshot")) {
+			do_snapshot(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "snapshots")) {
+			do_snapshots(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "rmsnapshot")) {
+			do_rmsnapshot(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "resync")) {
+			do_resync(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "policy")) {
+			do_policy(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "defrag")) {
+			do_defrag(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "trace")) {
+			do_trace(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "import-dir")) {
+			do_import_dir(*disk, fs, args, arg1, arg2);
+		} else if (streq(cmd, "export-dir")) {
+			do_export_dir(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "help")) {
-			do_help(disk, fs, args, arg1, arg2);
+			do_help(*disk, fs, args, arg1, arg2);
 		} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
 			break;
 		} else {
 			printf("Unknown command: %s", line);
 			printf("Type 'help' for a list of commands.\n");
+			Failures++;
 		}
 	}
 
-	return EXIT_SUCCESS;
+	// Scripts flush once, when they finish
+
+	if (batch && disk->mounted() && !fs.umount(disk)) {
+		printf("unmount failed!\n");
+		Failures++;
+	}
+
+	delete disk;
+	return batch && Failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 // Command functions
@@ -103,6 +218,7 @@ int main(int argc, char *argv[]) {
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 1) {
 		printf("Usage: debug\n");
+		Failures++;
 		return;
 	}
 
@@ -110,34 +226,42 @@ void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-	if (args != 1) {
-		printf("Usage: format\n");
+	if (args > 3) {
+		printf("Usage: format [blocksize] [inode%%]\n");
+		Failures++;
 		return;
 	}
 
-	if (fs.format(&disk)) {
+	size_t   blockSize = args >= 2 ? atoi(arg1) : Disk::BLOCK_SIZE;
+	uint32_t inodes    = args == 3 ? atoi(arg2) : FileSystem::INODES_PERCENT;
+
+	if (fs.format(&disk, blockSize, inodes)) {
 		printf("disk formatted.\n");
 	} else {
 		printf("format failed!\n");
+		Failures++;
 	}
 }
 
 void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-	if (args != 1) {
-		printf("Usage: mount\n");
+	if (args != 1 && args != 2) {
+		printf("Usage: mount [snapshot]\n");
+		Failures++;
 		return;
 	}
 
-	if (fs.mount(&disk)) {
+	if (fs.mount(&disk, args == 2 ? atoi(arg1) : -1)) {
 		printf("disk mounted.\n");
 	} else {
 		printf("mount failed!\n");
+		Failures++;
 	}
 }
 
 void do_umount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 1) {
 		printf("Usage: umount\n");
+		Failures++;
 		return;
 	}
 
@@ -145,34 +269,40 @@ void do_umount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 		printf("disk unmounted.\n");
 	} else {
 		printf("unmount failed!\n");
+		Failures++;
 	}
 }
 
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 2) {
 		printf("Usage: cat <inode>\n");
+		Failures++;
 		return;
 	}
 
 	if (!copyout(fs, atoi(arg1), "/dev/stdout")) {
 		printf("cat failed!\n");
+		Failures++;
 	}
 }
 
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 3) {
 		printf("Usage: copyout <inode> <file>\n");
+		Failures++;
 		return;
 	}
 
 	if (!copyout(fs, atoi(arg1), arg2)) {
 		printf("copyout failed!\n");
+		Failures++;
 	}
 }
 
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 1) {
 		printf("Usage: create\n");
+		Failures++;
 		return;
 	}
 
@@ -181,12 +311,14 @@ void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 		printf("created inode %ld.\n", inumber);
 	} else {
 		printf("create failed!\n");
+		Failures++;
 	}
 }
 
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 2) {
 		printf("Usage: remove <inode>\n");
+		Failures++;
 		return;
 	}
 
@@ -195,12 +327,14 @@ void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 		printf("removed inode %ld.\n", inumber);
 	} else {
 		printf("remove failed!\n");
+		Failures++;
 	}
 }
 
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 2) {
 		printf("Usage: stat <inode>\n");
+		Failures++;
 		return;
 	}
 
@@ -210,24 +344,257 @@ void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 		printf("inode %ld has size %ld bytes.\n", inumber, bytes);
 	} else {
 		printf("stat failed!\n");
+		Failures++;
 	}
 }
 
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	if (args != 3) {
 		printf("Usage: copyin <inode> <file>\n");
+		Failures++;
 		return;
 	}
 
 	if (!copyin(fs, arg1, atoi(arg2))) {
 		printf("copyin failed!\n");
+		Failures++;
+	}
+}
+
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 2) {
+		printf("Usage: clone <inode>\n");
+		Failures++;
+		return;
+	}
+
+	ssize_t inumber = fs.clone(atoi(arg1));
+	if (inumber >= 0) {
+		printf("cloned inode %s to inode %ld.\n", arg1, inumber);
+	} else {
+		printf("clone failed!\n");
+		Failures++;
+	}
+}
+
+void do_snapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 1) {
+		printf("Usage: snapshot\n");
+		Failures++;
+		return;
+	}
+
+	ssize_t snapshot = fs.snapshot();
+	if (snapshot >= 0) {
+		printf("created snapshot %ld.\n", snapshot);
+	} else {
+		printf("snapshot failed!\n");
+		Failures++;
+	}
+}
+
+void do_snapshots(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 1) {
+		printf("Usage: snapshots\n");
+		Failures++;
+		return;
+	}
+
+	fs.snapshots();
+}
+
+void do_rmsnapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 2) {
+		printf("Usage: rmsnapshot <snapshot>\n");
+		Failures++;
+		return;
+	}
+
+	ssize_t snapshot = atoi(arg1);
+	if (fs.removeSnapshot(snapshot)) {
+		printf("removed snapshot %ld.\n", snapshot);
+	} else {
+		printf("rmsnapshot failed!\n");
+		Failures++;
 	}
 }
 
+void do_resync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if ((args != 1 && args != 2) || (args == 2 && !streq(arg1, "full"))) {
+		printf("Usage: resync [full]\n");
+		Failures++;
+		return;
+	}
+
+	MirroredDisk *mirrored = dynamic_cast<MirroredDisk *>(&disk);
+	if (mirrored == nullptr) {
+		printf("resync needs a mirrored disk!\n");
+		Failures++;
+		return;
+	}
+
+	printf("%lu blocks resynced.\n", mirrored->resync(args == 2));
+
+	size_t conflicts = mirrored->conflicts();
+	if (conflicts > 0) {
+		printf("%lu blocks have no majority copy and were left alone!\n", conflicts);
+		Failures++;
+	}
+}
+
+void do_policy(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 1 && args != 2) {
+		printf("Usage: policy [first-fit | next-fit | best-fit | groups]\n");
+		Failures++;
+		return;
+	}
+
+	if (args == 2 && !fs.setPolicy(arg1)) {
+		printf("unknown policy %s!\n", arg1);
+		Failures++;
+		return;
+	}
+
+	printf("allocation policy is %s.\n", fs.policy());
+	if (disk.mounted()) {
+		printf("file fragmentation: %.3f\n", fs.fileFragmentation());
+		printf("free space fragmentation: %.3f\n", fs.freeFragmentation());
+	}
+}
+
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 1) {
+		printf("Usage: defrag\n");
+		Failures++;
+		return;
+	}
+
+	if (!disk.mounted()) {
+		printf("defrag needs a mounted disk!\n");
+		Failures++;
+		return;
+	}
+
+	// The shell serves nothing else meanwhile, so this runs to completion;
+	// sfsd -d defragments in the background while it serves clients
+
+	double before = fs.fileFragmentation();
+	size_t files = 0, relocated = 0, blocks = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto report = start;
+
+	size_t moved;
+	for (ssize_t inumber = fs.defrag(0, moved); inumber >= 0; inumber = fs.defrag(inumber + 1, moved)) {
+		files++;
+		if (moved) {
+			relocated++;
+			blocks += moved;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - report >= std::chrono::seconds(1)) {
+			printf("defrag: inode %ld, %lu files relocated, %lu blocks moved\n", inumber, relocated, blocks);
+			fflush(stdout);
+			report = now;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%lu files examined, %lu relocated, %lu blocks moved in %.3f seconds\n", files, relocated, blocks, seconds);
+	printf("file fragmentation: %.3f -> %.3f\n", before, fs.fileFragmentation());
+	printf("free space fragmentation: %.3f\n", fs.freeFragmentation());
+}
+
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (!Trace::available()) {
+		printf("tracing not compiled in (make TRACE=1)!\n");
+		Failures++;
+		return;
+	}
+
+	if (args == 2 && streq(arg1, "on")) {
+		Trace::enable(true);
+	} else if (args == 2 && streq(arg1, "off")) {
+		Trace::enable(false);
+	} else if (args == 2 && streq(arg1, "clear")) {
+		Trace::clear();
+	} else if (args == 3 && streq(arg1, "dump")) {
+		if (!Trace::dump(arg2)) {
+			printf("unable to write trace to %s!\n", arg2);
+			Failures++;
+			return;
+		}
+		printf("trace written to %s\n", arg2);
+		return;
+	} else if (args != 1) {
+		printf("Usage: trace [on | off | clear | dump <file>]\n");
+		Failures++;
+		return;
+	}
+
+	printf("tracing is %s.\n", Trace::enabled() ? "on" : "off");
+}
+
+void do_import_dir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 2 && args != 3) {
+		printf("Usage: import-dir <dir> [threads]\n");
+		Failures++;
+		return;
+	}
+
+	std::vector<Transfer> files;
+	list_files(arg1, files);
+	std::sort(files.begin(), files.end(), [](const Transfer &a, const Transfer &b) { return a.path < b.path; });
+
+	// Inodes are handed out up front so numbering follows path order
+
+	for (size_t i = 0; i < files.size(); i++) {
+		ssize_t inumber = fs.create();
+		if (inumber < 0) {
+			printf("out of inodes after %lu of %lu files!\n", i, files.size());
+			Failures++;
+			files.resize(i);
+			break;
+		}
+		files[i].inumber = inumber;
+	}
+
+	run_transfers(fs, files, args == 3 ? atoi(arg2) : TRANSFER_THREADS, true, "imported");
+}
+
+void do_export_dir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+	if (args != 2 && args != 3) {
+		printf("Usage: export-dir <dir> [threads]\n");
+		Failures++;
+		return;
+	}
+
+	if (mkdir(arg1, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create %s: %s\n", arg1, strerror(errno));
+		printf("export-dir failed!\n");
+		Failures++;
+		return;
+	}
+
+	// Files are named after their inodes
+
+	std::vector<Transfer> files;
+	for (ssize_t inumber = fs.nextInode(0); inumber >= 0; inumber = fs.nextInode(inumber + 1)) {
+		Transfer transfer;
+		transfer.path = std::string(arg1) + "/" + std::to_string(inumber);
+		transfer.inumber = inumber;
+		transfer.bytes = -1;
+		files.push_back(transfer);
+	}
+
+	run_transfers(fs, files, args == 3 ? atoi(arg2) : TRANSFER_THREADS, false, "exported");
+}
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	printf("Commands are:\n");
-	printf("    format\n");
-	printf("    mount\n");
+	printf("    format  [blocksize] [inode%%]\n");
+	printf("    mount   [snapshot]\n");
 	printf("    debug\n");
 	printf("    create\n");
 	printf("    remove  <inode>\n");
@@ -235,6 +602,16 @@ void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 	printf("    stat    <inode>\n");
 	printf("    copyin  <file> <inode>\n");
 	printf("    copyout <inode> <file>\n");
+	printf("    clone   <inode>\n");
+	printf("    snapshot\n");
+	printf("    snapshots\n");
+	printf("    rmsnapshot <snapshot>\n");
+	printf("    resync  [full]\n");
+	printf("    policy  [name]\n");
+	printf("    defrag\n");
+	printf("    trace   [on | off | clear | dump <file>]\n");
+	printf("    import-dir <dir> [threads]\n");
+	printf("    export-dir <dir> [threads]\n");
 	printf("    help\n");
 	printf("    quit\n");
 	printf("    exit\n");
@@ -247,15 +624,55 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
 		return false;
 	}
 
+	ssize_t size = fs.stat(inumber);
+	if (size < 0) {
+		fclose(stream);
+		return false;
+	}
+
+	// Holes are skipped in regular files and written out as zeros elsewhere
+
+	struct stat st;
+	bool sparse = fstat(fileno(stream), &st) == 0 && S_ISREG(st.st_mode);
+
 	char buffer[4*BUFSIZ] = {0};
 	size_t offset = 0;
-	while (true) {
-		ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
-		if (result <= 0) {
+	while ((ssize_t)offset < size) {
+		ssize_t data = fs.seekData(inumber, offset);
+		if (data < 0) {
+			data = size;
+		}
+
+		if (sparse) {
+			fseek(stream, data, SEEK_SET);
+		} else {
+			memset(buffer, 0, sizeof(buffer));
+			for (size_t hole = offset; hole < (size_t)data; hole += sizeof(buffer)) {
+				fwrite(buffer, 1, std::min(sizeof(buffer), data - hole), stream);
+			}
+		}
+		offset = data;
+
+		ssize_t hole = fs.seekHole(inumber, offset);
+		while ((ssize_t)offset < hole) {
+			ssize_t result = fs.read(inumber, buffer, std::min(sizeof(buffer), (size_t)(hole - offset)), offset);
+			if (result <= 0) {
+				break;
+			}
+			fwrite(buffer, 1, result, stream);
+			offset += result;
+		}
+
+		if ((ssize_t)offset < hole) {
 			break;
 		}
-		fwrite(buffer, 1, result, stream);
-		offset += result;
+	}
+
+	// A trailing hole still has to extend the file
+
+	fflush(stream);
+	if (sparse && ftruncate(fileno(stream), offset) < 0) {
+		fprintf(stderr, "Unable to truncate %s: %s\n", path, strerror(errno));
 	}
 
 	printf("%lu bytes copied\n", offset);
@@ -264,33 +681,216 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
 }
 
 bool copyin(FileSystem &fs, const char *path, size_t inumber) {
-	FILE *stream = fopen(path, "r");
-	if (stream == nullptr) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
 		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
 		return false;
 	}
 
-	char buffer[4*BUFSIZ] = {0};
+	std::mutex lock;
+	char buffer[4*BUFSIZ];
+	ssize_t offset = import_data(fs, lock, fd, path, inumber, buffer, sizeof(buffer));
+	close(fd);
+
+	if (offset < 0) {
+		return false;
+	}
+
+	printf("%lu bytes copied\n", offset);
+	return true;
+}
+
+void list_files(const std::string &dir, std::vector<Transfer> &files) {
+	DIR *stream = opendir(dir.c_str());
+	if (stream == nullptr) {
+		fprintf(stderr, "Unable to open %s: %s\n", dir.c_str(), strerror(errno));
+		return;
+	}
+
+	for (struct dirent *entry = readdir(stream); entry != nullptr; entry = readdir(stream)) {
+		if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) {
+			continue;
+		}
+
+		std::string path = dir + "/" + entry->d_name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) < 0) {
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			list_files(path, files);
+		} else if (S_ISREG(st.st_mode)) {
+			Transfer transfer;
+			transfer.path = path;
+			transfer.inumber = 0;
+			transfer.bytes = -1;
+			files.push_back(transfer);
+		}
+	}
+
+	closedir(stream);
+}
+
+// Host I/O runs on worker threads; the file system itself is only touched
+// under one lock and is not synced until it is unmounted
+void run_transfers(FileSystem &fs, std::vector<Transfer> &transfers, size_t threads, bool import, const char *verb) {
+	std::mutex lock;
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+
+	threads = std::max<size_t>(1, std::min(threads, TRANSFER_THREADS));
+	auto start = std::chrono::steady_clock::now();
+
+	for (size_t t = 0; t < std::min(threads, transfers.size()); t++) {
+		workers.push_back(std::thread([&]() {
+			char *buffer;
+			if (posix_memalign((void **)&buffer, TRANSFER_ALIGN, TRANSFER_SIZE) != 0) {
+				return;
+			}
+
+			for (size_t i = next++; i < transfers.size(); i = next++) {
+				transfers[i].bytes = import ? import_file(fs, lock, transfers[i], buffer) : export_file(fs, lock, transfers[i], buffer);
+			}
+
+			free(buffer);
+		}));
+	}
+
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t files = 0, bytes = 0;
+	for (size_t i = 0; i < transfers.size(); i++) {
+		if (transfers[i].bytes < 0) {
+			printf("%s: inode %lu failed!\n", transfers[i].path.c_str(), transfers[i].inumber);
+			Failures++;
+			continue;
+		}
+		if (import) {
+			printf("%s -> inode %lu\n", transfers[i].path.c_str(), transfers[i].inumber);
+		}
+		files++;
+		bytes += transfers[i].bytes;
+	}
+
+	printf("%lu files, %lu bytes %s in %.3f seconds (%.2f MB/s)\n", files, bytes, verb, seconds,
+	       seconds > 0 ? bytes / seconds / (1 << 20) : 0.0);
+}
+
+ssize_t import_file(FileSystem &fs, std::mutex &lock, Transfer &transfer, char *buffer) {
+	ssize_t offset = -1;
+	int fd = open(transfer.path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", transfer.path.c_str(), strerror(errno));
+	} else {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		offset = import_data(fs, lock, fd, transfer.path.c_str(), transfer.inumber, buffer, TRANSFER_SIZE);
+		close(fd);
+	}
+
+	// The inode was handed out before the copy, so a failed one is removed
+	// rather than left half written, and its blocks go to the next files
+
+	if (offset < 0) {
+		std::lock_guard<std::mutex> guard(lock);
+		fs.remove(transfer.inumber);
+	}
+
+	return offset;
+}
+
+// Regular files are read by offset so holes in them stay holes in the inode;
+// anything else (a pipe, a terminal) is read through to the end
+ssize_t import_data(FileSystem &fs, std::mutex &lock, int fd, const char *path, size_t inumber, char *buffer, size_t size) {
+	struct stat st;
+	bool sparse = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
 	size_t offset = 0;
 	while (true) {
-		ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
-		if (result <= 0) {
+		off_t data = sparse ? lseek(fd, offset, SEEK_DATA) : offset;
+		if (data < 0 && errno == ENXIO) {
+			// A trailing hole still has to extend the inode, without backing it
+			if ((off_t)offset < st.st_size) {
+				std::lock_guard<std::mutex> guard(lock);
+				if (!fs.truncate(inumber, st.st_size)) {
+					fprintf(stderr, "%s: fs.truncate could not extend inode %lu to %ld bytes\n", path, inumber, st.st_size);
+					return -1;
+				}
+				offset = st.st_size;
+			}
 			break;
 		}
+		if (data > (off_t)offset) {
+			offset = data;
+		}
 
-		ssize_t actual = fs.write(inumber, buffer, result, offset);
-		if (actual < 0) {
-			fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
+		ssize_t result = sparse ? pread(fd, buffer, size, offset) : read(fd, buffer, size);
+		if (result < 0) {
+			fprintf(stderr, "Unable to read %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		if (result == 0) {
 			break;
 		}
-		offset += actual;
+
+		std::lock_guard<std::mutex> guard(lock);
+		ssize_t actual = fs.write(inumber, buffer, result, offset);
 		if (actual != result) {
-			fprintf(stderr, "fs.write only wrote %ld bytes, not %ld bytes\n", actual, result);
-			break;
+			fprintf(stderr, "%s: fs.write only wrote %ld bytes, not %ld bytes\n", path, actual, result);
+			return -1;
 		}
+		offset += actual;
 	}
 
-	printf("%lu bytes copied\n", offset);
-	fclose(stream);
-	return true;
+	return offset;
+}
+
+ssize_t export_file(FileSystem &fs, std::mutex &lock, Transfer &transfer, char *buffer) {
+	int fd = open(transfer.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", transfer.path.c_str(), strerror(errno));
+		return -1;
+	}
+
+	ssize_t size;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		size = fs.stat(transfer.inumber);
+	}
+
+	// Only data regions are copied; the final truncate leaves the holes
+
+	ssize_t offset = 0;
+	while (offset < size) {
+		ssize_t result;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			ssize_t data = fs.seekData(transfer.inumber, offset);
+			if (data < 0) {
+				offset = size;
+				break;
+			}
+			ssize_t hole = fs.seekHole(transfer.inumber, data);
+			offset = data;
+			result = fs.read(transfer.inumber, buffer, std::min<size_t>(TRANSFER_SIZE, hole - data), offset);
+		}
+
+		if (result <= 0 || pwrite(fd, buffer, result, offset) != result) {
+			close(fd);
+			return -1;
+		}
+		offset += result;
+	}
+
+	if (size < 0 || ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return size;
 }
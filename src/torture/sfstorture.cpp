@@ -0,0 +1,398 @@
+// sfstorture.cpp: Crash-consistency torture test
+
+#include "sfs/disk.h"
+#include "sfs/faulty.h"
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Each case formats an in-memory disk, runs a random workload, unmounts, runs
+// a second workload and then replays the second unmount's writes up to every
+// write boundary (or an even sample of them), cut cleanly, torn mid-block or
+// with the latest writes reordered. Every crash state is remounted and must either be rejected
+// cleanly or read back without errors, survive new allocations and remount
+// again. The states before and after the workload must match it exactly.
+
+const static size_t CASE_TIMEOUT = 120;		// Seconds before a hung case fails
+const static size_t MAX_SNAPSHOTS = 2;		// Snapshots taken per workload
+
+typedef std::map<size_t, std::string> Files;	// Expected contents by inode
+
+struct Options {
+	size_t cases;		// Number of cases to run
+	size_t jobs;		// Cases run at once
+	size_t operations;	// Operations per workload
+	size_t points;		// Crash points sampled per case plus both ends (0 for every write)
+	unsigned seed;		// Seed of the first case
+	bool verbose;		// Report every case
+};
+
+struct Result {
+	size_t states;		// Crash states checked
+	size_t mounted;		// States that mounted
+	size_t damaged;		// Files matching neither workload after a crash
+	size_t failures;	// Invariants broken
+};
+
+// Helper functions
+
+void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-c cases] [-j jobs] [-o operations] [-p points] [-s seed] [-v]\n", program);
+}
+
+void fail(Result &result, unsigned seed, const char *state, const char *what) {
+	fprintf(stderr, "case %u: %s: %s\n", seed, state, what);
+	result.failures++;
+}
+
+bool read_file(FileSystem &fs, size_t inumber, std::string &data) {
+	ssize_t size = fs.stat(inumber);
+	if (size < 0) {
+		return false;
+	}
+
+	data.assign(size, 0);
+	return size == 0 || fs.read(inumber, &data[0], size, 0) == size;
+}
+
+// Read every file, returning false if any listed inode cannot be read back
+bool read_files(FileSystem &fs, Files &files) {
+	files.clear();
+	for (ssize_t inumber = fs.nextInode(0); inumber >= 0; inumber = fs.nextInode(inumber + 1)) {
+		if (!read_file(fs, inumber, files[inumber])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void random_fill(std::mt19937 &random, std::string &data) {
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = random();
+	}
+}
+
+// Run random operations against a mounted file system, tracking expected contents
+void run_workload(FileSystem &fs, Files &files, std::mt19937 &random, size_t operations, size_t blockSize) {
+	size_t snapshots = 0;
+
+	for (size_t n = 0; n < operations; n++) {
+		unsigned op = random() % 10;
+
+		if (op < 2 || files.empty()) {
+			ssize_t inumber = fs.create();
+			if (inumber >= 0) {
+				files[inumber] = "";
+			}
+			continue;
+		}
+
+		Files::iterator file = files.begin();
+		std::advance(file, random() % files.size());
+		std::string &data = file->second;
+
+		if (op < 6) {
+			// Writes land anywhere up to a block past the end, leaving holes
+
+			size_t offset = random() % (data.size() + blockSize);
+			std::string chunk(1 + random() % (4 * blockSize), 0);
+			random_fill(random, chunk);
+
+			if (fs.write(file->first, &chunk[0], chunk.size(), offset) == (ssize_t)chunk.size()) {
+				data.resize(std::max(data.size(), offset + chunk.size()), 0);
+				data.replace(offset, chunk.size(), chunk);
+			} else {
+				read_file(fs, file->first, data);	// Out of space part way
+			}
+		} else if (op < 7) {
+			size_t size = random() % (data.size() + 1);
+			if (fs.truncate(file->first, size)) {
+				data.resize(size);
+			}
+		} else if (op < 8) {
+			if (fs.remove(file->first)) {
+				files.erase(file);
+			}
+		} else if (op < 9 || snapshots >= MAX_SNAPSHOTS) {
+			ssize_t inumber = fs.clone(file->first);
+			if (inumber >= 0) {
+				files[inumber] = data;
+			}
+		} else if (fs.snapshot() >= 0) {
+			snapshots++;
+		}
+	}
+}
+
+// Mount one crash state and check it; expected is null when any outcome is allowed
+void check_state(FaultyDisk &disk, const Files &before, const Files &after, const Files *expected, std::mt19937 &random, Result &result, unsigned seed, const char *state) {
+	result.states++;
+
+	try {
+		FileSystem fs;
+		if (!fs.mount(&disk)) {
+			if (expected) {
+				fail(result, seed, state, "mount failed");
+			}
+			return;
+		}
+		result.mounted++;
+
+		Files found;
+		if (!read_files(fs, found)) {
+			fail(result, seed, state, "file unreadable after mount");
+			fs.umount(&disk);
+			return;
+		}
+
+		if (expected && found != *expected) {
+			fail(result, seed, state, "contents differ from workload");
+		}
+
+		for (Files::iterator file = found.begin(); file != found.end(); file++) {
+			Files::const_iterator old = before.find(file->first), now = after.find(file->first);
+			if ((old == before.end() || old->second != file->second) && (now == after.end() || now->second != file->second)) {
+				result.damaged++;
+			}
+		}
+
+		// New blocks must come from free space, so the surviving files stay put
+
+		ssize_t inumber = fs.create();
+		std::string fresh(3 * disk.blockSize(), 0);
+		random_fill(random, fresh);
+		if (inumber >= 0 && fs.write(inumber, &fresh[0], fresh.size(), 0) != (ssize_t)fresh.size()) {
+			fs.remove(inumber);
+			inumber = -1;
+		}
+		fs.umount(&disk);
+
+		FileSystem again;
+		if (!again.mount(&disk)) {
+			fail(result, seed, state, "remount after repair failed");
+			return;
+		}
+
+		Files reread;
+		std::string check;
+		if (!read_files(again, reread)) {
+			fail(result, seed, state, "file unreadable after remount");
+		} else {
+			if (inumber >= 0) {
+				check = reread[inumber];
+				reread.erase(inumber);
+			}
+			if (reread != found) {
+				fail(result, seed, state, "files changed by a new allocation");
+			}
+			if (inumber >= 0 && check != fresh) {
+				fail(result, seed, state, "new file lost");
+			}
+		}
+		again.umount(&disk);
+
+		// Snapshots that survived must mount read-only and read back
+
+		for (size_t snapshot = 0; snapshot < MAX_SNAPSHOTS; snapshot++) {
+			FileSystem frozen;
+			if (frozen.mount(&disk, snapshot)) {
+				Files contents;
+				if (!read_files(frozen, contents)) {
+					fail(result, seed, state, "snapshot unreadable");
+				}
+				frozen.umount(&disk);
+			}
+		}
+	} catch (std::exception &e) {
+		fail(result, seed, state, e.what());
+	}
+}
+
+// Run one case; the seed picks the geometry, the workloads and the faults
+Result run_case(unsigned seed, const Options &options) {
+	std::mt19937 random(seed);
+	Result result;
+	memset(&result, 0, sizeof(result));
+
+	size_t blockSize = random() % 2 ? Disk::BLOCK_SIZE : 4 * Disk::BLOCK_SIZE;
+	uint32_t inodesPercent = random() % 2 ? FileSystem::INODES_PERCENT : 0;
+	size_t nblocks = 256 + random() % 256;
+
+	FaultyDisk disk;
+	disk.open(nblocks);
+	if (!FileSystem::format(&disk, blockSize, inodesPercent)) {
+		fail(result, seed, "format", "format failed");
+		return result;
+	}
+
+	// The first workload is durable; crashes cut into the second one's unmount
+
+	Files before, after;
+	FileSystem fs;
+	fs.mount(&disk);
+	run_workload(fs, before, random, options.operations, blockSize);
+	fs.umount(&disk);
+	disk.checkpoint();
+
+	fs.mount(&disk);
+	after = before;
+	run_workload(fs, after, random, options.operations, blockSize);
+	fs.umount(&disk);
+
+	size_t writes = disk.writes();
+	size_t sectors = blockSize / FaultyDisk::SECTOR_SIZE;
+	char state[BUFSIZ];
+
+	size_t steps = options.points ? options.points + 1 : std::max(writes, (size_t)1);
+
+	for (size_t point = 0; point <= steps; point++) {
+		size_t count = std::min(writes, point * writes / steps);
+
+		FaultyDisk clean = disk;
+		clean.crash(count);
+		snprintf(state, BUFSIZ, "crash after %lu of %lu writes", count, writes);
+		check_state(clean, before, after, count == 0 ? &before : count == writes ? &after : nullptr, random, result, seed, state);
+
+		if (count > 0) {
+			size_t torn = 1 + random() % (sectors - 1);
+			FaultyDisk tear = disk;
+			tear.crash(count, torn);
+			snprintf(state, BUFSIZ, "write %lu of %lu torn after %lu sectors", count, writes, torn);
+			check_state(tear, before, after, nullptr, random, result, seed, state);
+
+			size_t reorder = 1 + random() % 16;
+			FaultyDisk cached = disk;
+			cached.crash(count, 0, reorder, random());
+			snprintf(state, BUFSIZ, "crash after %lu of %lu writes losing some of the last %lu", count, writes, reorder);
+			check_state(cached, before, after, nullptr, random, result, seed, state);
+		}
+	}
+
+	return result;
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+	Options options;
+	options.cases = 64;
+	options.jobs = std::max(1u, std::thread::hardware_concurrency());
+	options.operations = 200;
+	options.points = 0;
+	options.seed = 1;
+	options.verbose = false;
+
+	int c;
+	while ((c = getopt(argc, argv, "c:j:o:p:s:v")) != -1) {
+		switch (c) {
+			case 'c': options.cases = strtoul(optarg, nullptr, 10); break;
+			case 'j': options.jobs = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+			case 'o': options.operations = strtoul(optarg, nullptr, 10); break;
+			case 'p': options.points = strtoul(optarg, nullptr, 10); break;
+			case 's': options.seed = strtoul(optarg, nullptr, 10); break;
+			case 'v': options.verbose = true; break;
+			default:  usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+
+	printf("Running %lu cases from seed %u on %lu jobs...\n", options.cases, options.seed, options.jobs);
+	fflush(stdout);
+
+	// Each case runs in its own process so a crash or hang only fails that case
+
+	struct Job {
+		unsigned seed;
+		int fd;		// Read end of the pipe carrying the Result
+	};
+
+	std::map<pid_t, Job> running;
+	Result total;
+	memset(&total, 0, sizeof(total));
+	size_t next = 0, failed = 0;
+
+	while (next < options.cases || !running.empty()) {
+		if (next < options.cases && running.size() < options.jobs) {
+			unsigned seed = options.seed + next++;
+			int fds[2];
+			if (pipe(fds) < 0) {
+				perror("pipe");
+				return EXIT_FAILURE;
+			}
+
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				return EXIT_FAILURE;
+			}
+
+			if (pid == 0) {
+				close(fds[0]);
+				alarm(CASE_TIMEOUT);
+				if (!freopen("/dev/null", "w", stdout)) {
+					_exit(EXIT_FAILURE);
+				}
+
+				Result result = run_case(seed, options);
+				ssize_t written = write(fds[1], &result, sizeof(result));
+				_exit(written == sizeof(result) && !result.failures ? EXIT_SUCCESS : EXIT_FAILURE);
+			}
+
+			close(fds[1]);
+			running[pid] = Job{seed, fds[0]};
+			continue;
+		}
+
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			perror("wait");
+			return EXIT_FAILURE;
+		}
+
+		Job job = running[pid];
+		running.erase(pid);
+
+		Result result;
+		bool reported = read(job.fd, &result, sizeof(result)) == sizeof(result);
+		close(job.fd);
+
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "case %u: killed by %s\n", job.seed, strsignal(WTERMSIG(status)));
+		}
+
+		if (!reported || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			failed++;
+		}
+
+		if (reported) {
+			total.states   += result.states;
+			total.mounted  += result.mounted;
+			total.damaged  += result.damaged;
+			total.failures += result.failures;
+			if (options.verbose) {
+				printf("case %u: %lu crash states, %lu mounted, %lu damaged files, %lu failures\n",
+				       job.seed, result.states, result.mounted, result.damaged, result.failures);
+			}
+		}
+	}
+
+	printf("%lu crash states checked, %lu mounted\n", total.states, total.mounted);
+	printf("%lu files damaged (no journal is checked, so files caught mid-update are reported but not failed)\n", total.damaged);
+	printf("%lu of %lu cases failed\n", failed, options.cases);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}